@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <modbus/modbus.h>
+#include "exporter485.h"
+
+#define CAPTURE_MAGIC       0x48353843  /* "485C" */
+#define CAPTURE_VERSION     1
+
+/* A capture file is the header followed by records, each a record header and
+ * then the request and response bytes. Failed exchanges have an errno and no
+ * response.
+ */
+typedef struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+} capture_header_t;
+
+typedef struct capture_record {
+    uint64_t time_us;           /* Since the capture was started */
+    uint32_t duration_us;
+    int32_t err;
+    uint16_t req_len;
+    uint16_t rsp_len;
+    uint8_t kind;
+    uint8_t reserved[3];
+} capture_record_t;
+
+struct capture {
+    FILE *file;                 /* Recording */
+    int64_t start_us;
+    char *data;                 /* Replaying, the whole file */
+    size_t *records;            /* Record offsets in data */
+    unsigned int records_count;
+    unsigned int next;
+    int fast;
+};
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static capture_t *capture_record_open(const char *filename)
+{
+    capture_header_t header = { .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION };
+    capture_t *capture = calloc(1, sizeof(capture_t));
+
+    if (!capture)
+        return NULL;
+    if (!(capture->file = fopen(filename, "w")) ||
+        fwrite(&header, sizeof(header), 1, capture->file) != 1) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        goto error;
+    }
+    capture->start_us = now_us();
+    return capture;
+
+error:
+    if (capture->file)
+        fclose(capture->file);
+    free(capture);
+    return NULL;
+}
+
+static capture_t *capture_replay_open(const char *filename, int fast)
+{
+    capture_t *capture = calloc(1, sizeof(capture_t));
+    struct stat st;
+    FILE *f = NULL;
+
+    if (!capture)
+        return NULL;
+    capture->fast = fast;
+
+    if (!(f = fopen(filename, "r")) || fstat(fileno(f), &st) < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        goto error;
+    }
+    if (!(capture->data = malloc(st.st_size + 1)) ||
+        fread(capture->data, 1, st.st_size, f) != st.st_size)
+        goto invalid;
+
+    capture_header_t header;
+    if (st.st_size < sizeof(header))
+        goto invalid;
+    memcpy(&header, capture->data, sizeof(header));
+    if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION)
+        goto invalid;
+
+    size_t pos = sizeof(header);
+    while (pos < st.st_size) {
+        capture_record_t record;
+
+        if (pos + sizeof(record) > st.st_size)
+            goto invalid;
+        memcpy(&record, capture->data + pos, sizeof(record));
+        if (pos + sizeof(record) + record.req_len + record.rsp_len > st.st_size)
+            goto invalid;
+
+        size_t *records = realloc(capture->records, (capture->records_count + 1) * sizeof(size_t));
+        if (!records)
+            goto invalid;
+        capture->records = records;
+        capture->records[capture->records_count++] = pos;
+        pos += sizeof(record) + record.req_len + record.rsp_len;
+    }
+
+    fclose(f);
+    printf("Replaying %u exchanges from %s\n", capture->records_count, filename);
+    return capture;
+
+invalid:
+    fprintf(stderr, "%s: invalid or incompatible capture file\n", filename);
+error:
+    if (f)
+        fclose(f);
+    capture_close(capture);
+    return NULL;
+}
+
+capture_t *capture_open(const char *filename, int replay, int fast)
+{
+    return replay ? capture_replay_open(filename, fast) : capture_record_open(filename);
+}
+
+void capture_close(capture_t *capture)
+{
+    if (capture->file)
+        fclose(capture->file);
+    free(capture->records);
+    free(capture->data);
+    free(capture);
+}
+
+/* Records are flushed right away, so a capture survives the exporter being
+ * killed while reproducing a field problem.
+ */
+static void record(capture_t *capture, int kind, const uint8_t *req, size_t req_len,
+                   const uint8_t *rsp, int rsp_len, int64_t start_us, int err)
+{
+    capture_record_t record = {
+        .time_us = start_us - capture->start_us,
+        .duration_us = now_us() - start_us,
+        .err = rsp_len < 0 ? err : 0,
+        .req_len = req_len,
+        .rsp_len = rsp_len < 0 ? 0 : rsp_len,
+        .kind = kind
+    };
+
+    if (fwrite(&record, sizeof(record), 1, capture->file) != 1 ||
+        fwrite(req, 1, record.req_len, capture->file) != record.req_len ||
+        fwrite(rsp, 1, record.rsp_len, capture->file) != record.rsp_len ||
+        fflush(capture->file) == EOF)
+        fprintf(stderr, "capture: %s\n", strerror(errno));
+}
+
+/* Serves the next recorded exchange with the same request. Devices are
+ * usually read in the same order again, so the search starts after the
+ * previous match and wraps around once.
+ */
+static int replay(capture_t *capture, int kind, const uint8_t *req, size_t req_len,
+                  uint8_t *rsp, size_t rsp_size)
+{
+    for (unsigned int n = 0; n < capture->records_count; n++) {
+        unsigned int i = (capture->next + n) % capture->records_count;
+        const uint8_t *data = (const uint8_t *) capture->data + capture->records[i];
+        capture_record_t record;
+
+        /* Records are not aligned in the file */
+        memcpy(&record, data, sizeof(record));
+        data += sizeof(record);
+        if (record.kind != kind || record.req_len != req_len || memcmp(data, req, req_len) != 0)
+            continue;
+
+        capture->next = i + 1;
+        if (!capture->fast && record.duration_us)
+            usleep(record.duration_us);
+        if (record.err || record.rsp_len > rsp_size) {
+            errno = record.err ? record.err : EMBBADDATA;
+            return -1;
+        }
+        memcpy(rsp, data + req_len, record.rsp_len);
+        return record.rsp_len;
+    }
+
+    /* Not recorded, the device does not respond */
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/* Performs an exchange on the bus with io, recording it, or serves it from
+ * the recording when replaying. Returns the response length, or -1 with errno
+ * set.
+ */
+int capture_transact(exporter_t *exporter, int kind, const uint8_t *req, size_t req_len,
+                     uint8_t *rsp, size_t rsp_size, capture_io_fn io, void *ctx)
+{
+    capture_t *capture = exporter->capture;
+
+    if (!capture)
+        return io(exporter, ctx, req, req_len, rsp);
+    if (!capture->file)
+        return replay(capture, kind, req, req_len, rsp, rsp_size);
+
+    int64_t start_us = now_us();
+    int ret = io(exporter, ctx, req, req_len, rsp);
+    int err = errno;
+
+    record(capture, kind, req, req_len, rsp, ret, start_us, err);
+    errno = err;
+    return ret;
+}
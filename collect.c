@@ -27,42 +27,345 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <event2/buffer.h>
 #include <modbus/modbus.h>
 #include "exporter485.h"
 
 void metrics_value_set_free(metrics_value_set_t *values)
 {
     free(values->values);
+    free(values->valid);
     free(values);
 }
 
-metrics_value_set_t *metrics_value_set_collect(exporter_t *exporter, module_t *module, int target)
+/* Block error stats are updated by the bus thread and read by HTTP workers */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static target_stats_t *get_stats(exporter_t *exporter, module_t *module, int target)
+{
+    if (!exporter->stats) {
+        exporter->stats = calloc(exporter->modules->modules_count * (MAX_TARGET + 1),
+                                 sizeof(target_stats_t));
+        if (!exporter->stats)
+            return NULL;
+    }
+
+    return &exporter->stats[(module - exporter->modules->modules) * (MAX_TARGET + 1) + target];
+}
+
+/* Returns a copy of the block errors of a target, to be freed by the caller */
+block_errors_t *collect_get_block_errors(exporter_t *exporter, module_t *module, int target,
+                                         unsigned int *count)
+{
+    block_errors_t *blocks = NULL;
+
+    *count = 0;
+    pthread_mutex_lock(&stats_lock);
+    target_stats_t *stats = exporter->stats ? get_stats(exporter, module, target) : NULL;
+    if (stats && stats->blocks_count &&
+        (blocks = malloc(stats->blocks_count * sizeof(block_errors_t)))) {
+        memcpy(blocks, stats->blocks, stats->blocks_count * sizeof(block_errors_t));
+        *count = stats->blocks_count;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    return blocks;
+}
+
+static void record_block_error(exporter_t *exporter, module_t *module, int target, read_block_t *block)
 {
+    pthread_mutex_lock(&stats_lock);
+
+    target_stats_t *stats = get_stats(exporter, module, target);
+    if (!stats)
+        goto done;
+
+    for (int i = 0; i < stats->blocks_count; i++) {
+        block_errors_t *be = &stats->blocks[i];
+        if (be->input_type == block->input_type && be->address == block->address) {
+            be->count++;
+            goto done;
+        }
+    }
+
+    block_errors_t *blocks = realloc(stats->blocks, (stats->blocks_count + 1) * sizeof(block_errors_t));
+    if (!blocks)
+        goto done;
+
+    stats->blocks = blocks;
+    stats->blocks[stats->blocks_count++] = (block_errors_t) {
+        .count = 1,
+        .address = block->address,
+        .input_type = block->input_type
+    };
+
+done:
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Unpacks bits as packed in Modbus responses (the first bit is the LSB of the
+ * first byte) to one byte per bit, eight bits at a time.
+ */
+void unpack_bits(const uint8_t *packed, unsigned int count, uint8_t *bits)
+{
+    while (count) {
+        uint64_t x = (*packed++ * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+        x = ((x + 0x7f7f7f7f7f7f7f7fULL) >> 7) & 0x0101010101010101ULL;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        x = __builtin_bswap64(x);
+#endif
+        unsigned int n = count < 8 ? count : 8;
+        memcpy(bits, &x, n);
+        bits += n;
+        count -= n;
+    }
+}
+
+static int read_function(int input_type)
+{
+    switch (input_type) {
+        case INPUT_TYPE_COIL:
+            return MODBUS_FC_READ_COILS;
+        case INPUT_TYPE_DISCRETE_INPUT:
+            return MODBUS_FC_READ_DISCRETE_INPUTS;
+        case INPUT_TYPE_HOLDING_REGISTER:
+            return MODBUS_FC_READ_HOLDING_REGISTERS;
+        default:
+            return MODBUS_FC_READ_INPUT_REGISTERS;
+    }
+}
+
+static int modbus_io(exporter_t *exporter, void *ctx, const uint8_t *req, size_t req_len,
+                     uint8_t *rsp)
+{
+    if (modbus_send_raw_request(exporter->modbus, req, req_len) < 0)
+        return -1;
+    return modbus_receive_confirmation(exporter->modbus, rsp);
+}
+
+/* Sends a raw request (without CRC) and receives the confirmation, which rsp
+ * must have room for.
+ */
+int collect_transact(exporter_t *exporter, const uint8_t *req, size_t req_len, uint8_t *rsp)
+{
+    return capture_transact(exporter, CAPTURE_MODBUS, req, req_len, rsp, MODBUS_MAX_ADU_LENGTH,
+                            modbus_io, NULL);
+}
+
+/* Reads a block of the read plan. This uses a raw request, so coils and
+ * discrete inputs are received packed and can be unpacked in bulk.
+ */
+int collect_read_block(exporter_t *exporter, int target, read_block_t *block,
+                       uint16_t *regs, uint8_t *bits)
+{
+    int function = read_function(block->input_type);
+    int is_bits = (function == MODBUS_FC_READ_COILS || function == MODBUS_FC_READ_DISCRETE_INPUTS);
+
+    if (exporter->options.dry_run) {
+        static uint16_t counter = 0;
+        for (int i = 0; i < block->count; i++) {
+            if (is_bits)
+                bits[block->offset + i] = (counter + i) & 1;
+            else
+                regs[block->offset + i] = counter++;
+        }
+        return 0;
+    }
+
+    uint8_t req[] = { target, function,
+                      block->address >> 8, block->address & 0xff,
+                      block->count >> 8, block->count & 0xff };
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+
+    int len = collect_transact(exporter, req, sizeof(req), rsp);
+    if (len < 0)
+        return -1;
+
+    int offset = modbus_get_header_length(exporter->modbus);
+    int data_len = is_bits ? (block->count + 7) / 8 : block->count * 2;
+    if (len >= offset + 2 && rsp[offset] == (function | 0x80)) {
+        errno = MODBUS_ENOBASE + rsp[offset + 1];
+        return -1;
+    }
+    if (len < offset + 2 + data_len || rsp[offset] != function || rsp[offset + 1] != data_len) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    const uint8_t *data = rsp + offset + 2;
+    if (exporter->gateway)
+        gateway_cache_store(exporter->gateway, target, function, block->address, block->count, data);
+
+    if (is_bits) {
+        unpack_bits(data, block->count, bits + block->offset);
+    } else {
+        for (int i = 0; i < block->count; i++)
+            regs[block->offset + i] = data[i * 2] << 8 | data[i * 2 + 1];
+    }
+
+    return 0;
+}
+
+/* Bitfields are exported bit by bit, and never scaled */
+static void apply_factor(metric_t *metric, metric_value_t *value)
+{
+    if (!metric->factor || metric->bitfield)
+        return;
+
+    switch (metric->data_type) {
+        case DATA_TYPE_INT16:
+        case DATA_TYPE_INT32:
+            value->int_value *= metric->factor;
+            break;
+        case DATA_TYPE_UINT32:
+        case DATA_TYPE_UINT16:
+            value->uint_value *= metric->factor;
+            break;
+        case DATA_TYPE_FLOAT16:
+        case DATA_TYPE_FLOAT32:
+            value->float_value *= metric->factor;
+            break;
+        default:
+            break;
+    }
+}
+
+static int expr_operands_valid(const expr_t *expr, const metrics_value_set_t *values)
+{
+    for (int i = 0; i < expr->code_len; i++) {
+        if (expr->code[i].opcode == EXPR_OP_METRIC && !values->valid[expr->code[i].metric])
+            return 0;
+    }
+    return 1;
+}
+
+/* Derived metrics are evaluated once all registers are read, and only if all
+ * the metrics they refer to are valid. Results that are not finite (e.g.
+ * division by zero) are exported as 0 by integer types.
+ */
+static void eval_derived(modules_t *modules, module_t *module, const uint8_t *select,
+                         metrics_value_set_t *values)
+{
+    for (int i = 0; i < values->values_count; i++) {
+        metric_t *metric = &module->metrics[i];
+        if (metric->input_type != INPUT_TYPE_DERIVED || (select && !select[i]))
+            continue;
+
+        expr_t *expr = &modules->exprs[metric->address];
+        if (!expr_operands_valid(expr, values))
+            continue;
+        double result = expr_eval(expr->code, expr->code_len, module->metrics, values->values);
+
+        switch (metric->data_type) {
+            case DATA_TYPE_FLOAT16:
+            case DATA_TYPE_FLOAT32:
+                values->values[i].float_value = result;
+                break;
+            case DATA_TYPE_INT16:
+            case DATA_TYPE_INT32:
+                values->values[i].int_value = isfinite(result) ? (int) result : 0;
+                break;
+            case DATA_TYPE_UINT16:
+            case DATA_TYPE_UINT32:
+                values->values[i].uint_value = isfinite(result) && result > 0 ? (unsigned int) result : 0;
+                break;
+        }
+
+        apply_factor(metric, &values->values[i]);
+        values->valid[i] = 1;
+    }
+}
+
+/* Collects all metrics of a module, or only those selected by a group. A
+ * failed read only invalidates the metrics it covers, until more than
+ * error_budget reads have failed; the remaining reads are then skipped (a
+ * negative budget is unlimited).
+ */
+metrics_value_set_t *metrics_value_set_collect(exporter_t *exporter, module_t *module, int target,
+                                               const metric_group_t *group)
+{
+    struct timespec ts;
+    read_plan_t *plan = group ? group->plan : module->plan;
+    const uint8_t *select = group ? group->select : NULL;
+    read_plan_t *probed = NULL;
+    int temporary = 0;
+
+    /* Probed targets have plans of their own, without unsupported addresses */
+    if (exporter->probe && (probed = probe_get_plan(exporter, module, target, group, &temporary)))
+        plan = probed;
+
+    int budget = exporter->options.error_budget;
     metrics_value_set_t *values = calloc(1, sizeof(metrics_value_set_t));
     values->values_count = module->metrics_count;
     values->values = calloc(values->values_count, sizeof(metric_value_t));
+    values->valid = calloc(values->values_count, sizeof(uint8_t));
+
+    uint16_t *regs = calloc(plan->regs_count + 1, sizeof(uint16_t));
+    uint8_t *bits = calloc(plan->bits_count + 1, sizeof(uint8_t));
+    uint8_t *regs_ok = calloc(plan->regs_count + plan->bits_count + 1, sizeof(uint8_t));
+    uint8_t *bits_ok = regs_ok + plan->regs_count;
+    uint8_t frame[FRAME_MAX_LENGTH];
+    size_t frame_len = 0;
 
-    tbb_payload_t payload;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    values->timestamp = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 
     switch (module->module_type) {
         case MODULE_TYPE_MODBUS:
             if (!exporter->options.dry_run)
                 modbus_set_slave(exporter->modbus, target);
+            for (int i = 0; i < plan->blocks_count; i++) {
+                read_block_t *block = &plan->blocks[i];
+                int is_bits = (block->input_type == INPUT_TYPE_COIL ||
+                               block->input_type == INPUT_TYPE_DISCRETE_INPUT);
+
+                if (budget >= 0 && values->errors > budget)
+                    break;
+                if (collect_read_block(exporter, target, block, regs, bits) < 0) {
+                    int err = errno;
+
+                    fprintf(stderr, "%s: target %d: failed to read %s block at 0x%04x: %s\n",
+                            module->name, target, get_input_type_str(block->input_type),
+                            block->address, modbus_strerror(err));
+                    record_block_error(exporter, module, target, block);
+                    values->errors++;
+                    if (probed && err == EMBXILADD)
+                        probe_invalidate(exporter, module, target);
+                    continue;
+                }
+                memset((is_bits ? bits_ok : regs_ok) + block->offset, 1, block->count);
+            }
             break;
         case MODULE_TYPE_TBB_INVERTER:
-            if (tbb_get_payload(exporter, &payload) < 0)
-                goto error;
+        case MODULE_TYPE_FRAMED:
+            if (exporter->options.dry_run) {
+                frame_len = module->frame->length ? module->frame->length : FRAME_MAX_LENGTH;
+                memset(frame, 0, frame_len);
+            } else if (frame_transact(exporter, module->frame, target, frame, &frame_len) < 0) {
+                fprintf(stderr, "%s: target %d: failed to read frame: %s\n",
+                        module->name, target, modbus_strerror(errno));
+                values->errors++;
+            }
             break;
         default:
             goto error;
     }
 
     for (int i = 0; i < values->values_count; i++) {
-        metric_t *metric = module->metrics[i];
-        uint16_t reg[2];
+        metric_t *metric = &module->metrics[i];
+        uint16_t reg[2] = { 0, 0 };
 
-        /* Read one or two registers */
+        if (select && !select[i])
+            continue;
+
+        /* One or two registers */
         int nregs = 1;
         int low_reg = 0;
         int high_reg = 0;
@@ -75,25 +378,30 @@ metrics_value_set_t *metrics_value_set_collect(exporter_t *exporter, module_t *m
             nregs = 2;
         }
 
-        if (exporter->options.dry_run) {
-            static uint16_t counter = 0;
-            reg[0] = counter++;
-            if (nregs == 2) reg[1] = counter++;
-        } else {
-            switch (metric->input_type) {
-                case INPUT_TYPE_INPUT_REGISTER:
-                    if (modbus_read_input_registers(exporter->modbus, metric->address, nregs, reg) < 0)
-                        goto error;
-                    break;
-                case INPUT_TYPE_HOLDING_REGISTER:
-                    if (modbus_read_registers(exporter->modbus, metric->address, nregs, reg) < 0)
-                        goto error;
-                    break;
-                case INPUT_TYPE_PAYLOAD_OFFSET:
-                    /* Only supporting 16 bit values */
-                    reg[0] = (uint16_t) payload.data[metric->address] << 8 | payload.data[metric->address+1];
-                    break;
-            }
+        switch (metric->input_type) {
+            case INPUT_TYPE_DERIVED:
+                continue;
+            case INPUT_TYPE_COIL:
+            case INPUT_TYPE_DISCRETE_INPUT:
+                if (plan->slots[i] == READ_SLOT_NONE || !bits_ok[plan->slots[i]])
+                    continue;
+                reg[low_reg] = bits[plan->slots[i]];
+                break;
+            case INPUT_TYPE_INPUT_REGISTER:
+            case INPUT_TYPE_HOLDING_REGISTER:
+                if (plan->slots[i] == READ_SLOT_NONE || !regs_ok[plan->slots[i]])
+                    continue;
+                reg[0] = regs[plan->slots[i]];
+                if (nregs == 2)
+                    reg[1] = regs[plan->slots[i] + 1];
+                break;
+            case INPUT_TYPE_PAYLOAD_OFFSET:
+                /* Big endian registers, variable length frames may be short */
+                if (metric->address + nregs * 2 > frame_len)
+                    continue;
+                for (int j = 0; j < nregs; j++)
+                    reg[j] = frame[metric->address + j * 2] << 8 | frame[metric->address + j * 2 + 1];
+                break;
         }
 
         switch (metric->data_type) {
@@ -119,28 +427,45 @@ metrics_value_set_t *metrics_value_set_collect(exporter_t *exporter, module_t *m
                 goto error;
         }
 
-        if (metric->factor) {
-            switch (metric->data_type) {
-                case DATA_TYPE_INT16:
-                case DATA_TYPE_INT32:
-                    values->values[i].int_value *= metric->factor;
-                    break;
-                case DATA_TYPE_UINT32:
-                case DATA_TYPE_UINT16:
-                    values->values[i].uint_value *= metric->factor;
-                    break;
-                case DATA_TYPE_FLOAT16:
-                case DATA_TYPE_FLOAT32:
-                    values->values[i].float_value *= metric->factor;
-                    break;
-                default:
-                    break;
-            }
-        }
+        apply_factor(metric, &values->values[i]);
+        values->valid[i] = 1;
     }
+
+    eval_derived(exporter->modules, module, select, values);
+    free(regs);
+    free(bits);
+    free(regs_ok);
+    if (temporary)
+        read_plan_free(probed);
     return values;
 
 error:
+    free(regs);
+    free(bits);
+    free(regs_ok);
+    if (temporary)
+        read_plan_free(probed);
     metrics_value_set_free(values);
     return NULL;
 }
+
+/* Hands a collection to the consumers of every collection, wherever it was
+ * collected: the history, and the MQTT broker as <prefix>/<module>/<target>.
+ */
+void collect_record(exporter_t *exporter, module_t *module, int target,
+                    metrics_value_set_t *values)
+{
+    if (exporter->history)
+        history_record(exporter->history, module, target, values);
+
+    if (exporter->mqtt) {
+        struct evbuffer *buf = evbuffer_new();
+        char topic[256];
+
+        snprintf(topic, sizeof(topic), "%s/%s/%d", exporter->options.mqtt_topic, module->name, target);
+        if (buf && streams_render_json(buf, module, values, values->valid))
+            mqtt_publish(exporter->mqtt, topic, evbuffer_pullup(buf, -1), evbuffer_get_length(buf));
+        if (buf)
+            evbuffer_free(buf);
+    }
+}
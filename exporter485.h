@@ -30,21 +30,37 @@
 #ifndef EXPORTER485_H
 #define EXPORTER485_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <event2/http.h>
 
 /* Type of modbus input  */
 typedef enum input_type {
     INPUT_TYPE_HOLDING_REGISTER,
     INPUT_TYPE_INPUT_REGISTER,
-    INPUT_TYPE_PAYLOAD_OFFSET
+    INPUT_TYPE_PAYLOAD_OFFSET,
+    INPUT_TYPE_DERIVED,
+    INPUT_TYPE_COIL,
+    INPUT_TYPE_DISCRETE_INPUT
 } input_type_t;
 
 /* Type of module */
 typedef enum module_type {
     MODULE_TYPE_MODBUS,
     MODULE_TYPE_TBB_INVERTER,
+    MODULE_TYPE_FRAMED,
 } module_type_t;
 
+/* Checksum of framed protocol requests and responses, stored after the
+ * covered bytes. CRC16 is the Modbus one, stored little endian.
+ */
+typedef enum checksum_type {
+    CHECKSUM_NONE,
+    CHECKSUM_CRC16,
+    CHECKSUM_SUM8,
+    CHECKSUM_XOR8
+} checksum_type_t;
+
 /* Prometheus metric type */
 typedef enum metric_type {
     METRIC_TYPE_UNTYPED,
@@ -70,29 +86,275 @@ typedef enum word_order {
     WORD_ORDER_HIGH_LOW
 } word_order_t;
 
-/* Exported metric type */
-typedef struct metric {
+/* Metric, module and modules configuration, as loaded from the YAML file.
+ * These only exist while loading (and dumping) the configuration, and are
+ * converted to the compact run-time representation below.
+ */
+typedef struct metric_config {
     input_type_t input_type;
     metric_type_t metric_type;
     data_type_t data_type;
     word_order_t word_order;
-    unsigned int address;
+    unsigned int *address;      /* Required, except for derived metrics */
     char *name;
     char *help;
     float factor;
+    char *expression;
+    char **bits;
+    unsigned int bits_count;
+    float deadband;
+} metric_config_t;
+
+/* Framed protocol of a module: a fixed request, answered by a single frame
+ * that payloadOffset metrics are decoded from. The frame length is either
+ * fixed, or read from a big endian length field (plus adjust). Frames may
+ * begin with a start marker, and bytes received before it are skipped.
+ */
+typedef struct length_field_config {
+    unsigned int offset;
+    unsigned int size;
+    int adjust;
+} length_field_config_t;
+
+typedef struct frame_config {
+    unsigned int *request;
+    unsigned int request_count;
+    unsigned int *target_offset;    /* Request byte set to the target, if any */
+    unsigned int *start;
+    unsigned int start_count;
+    unsigned int length;
+    length_field_config_t *length_field;
+    checksum_type_t checksum;
+    unsigned int timeout;           /* ms */
+    unsigned int byte_timeout;      /* ms */
+} frame_config_t;
+
+/* Named subset of the metrics of a module, which can be collected alone */
+typedef struct group_config {
+    char *name;
+    char **metrics;
+    unsigned int metrics_count;
+} group_config_t;
+
+typedef struct module_config {
+    char *name;
+    module_type_t module_type;
+    unsigned int max_read_gap;
+    metric_config_t **metrics;
+    unsigned int metrics_count;
+    group_config_t *groups;
+    unsigned int groups_count;
+    frame_config_t *frame;
+} module_config_t;
+
+/* Background polling of a module/target pair */
+typedef struct poll_config {
+    char *module;
+    unsigned int target;
+    unsigned int interval;
+} poll_config_t;
+
+/* Module/target pairs collected back to back, as one consistent set */
+typedef struct fleet_config {
+    unsigned int interval;
+    poll_config_t *targets;
+    unsigned int targets_count;
+} fleet_config_t;
+
+typedef struct modules_config {
+    module_config_t **modules;
+    unsigned int modules_count;
+    poll_config_t *polls;
+    unsigned int polls_count;
+    fleet_config_t *fleet;
+} modules_config_t;
+
+/* Exported metric type.
+ *
+ * Type fields are packed, and name/help point into the interned string table
+ * of the owning modules_t. For derived metrics, address is the index of the
+ * compiled expression in modules_t. Bitfield metrics have their bit names
+ * in a bitfield_t, see modules_get_bitfield().
+ */
+typedef struct metric {
+    const char *name;
+    const char *help;
+    float factor;
+    uint16_t address;
+    unsigned int input_type : 4;
+    unsigned int metric_type : 2;
+    unsigned int data_type : 3;
+    unsigned int word_order : 1;
+    unsigned int bitfield : 1;
 } metric_t;
 
-/* A device class is a collection of metrics */
+/* Bit names of a bitfield metric, which is exported as one boolean series
+ * per named bit.
+ */
+typedef struct bitfield {
+    const metric_t *metric;
+    const char **names;         /* Indexed by bit number, NULL if unnamed */
+    unsigned int count;
+} bitfield_t;
+
+/* Read plan: the metrics of a module that are read from registers, coils or
+ * discrete inputs are batched into as few requests as possible. The data of
+ * all blocks is collected into one register array and one (unpacked) bit
+ * array; slots hold the offset of each metric's data in them, or
+ * READ_SLOT_NONE for metrics the plan does not read.
+ */
+#define READ_MAX_REGISTERS      125
+#define READ_MAX_BITS           2000
+#define READ_SLOT_NONE          UINT32_MAX
+
+/* Addresses a target does not allow reading, learned by probing. A hole with
+ * start == end only forbids merging reads across that address.
+ */
+typedef struct read_hole {
+    uint16_t start;
+    uint16_t end;               /* Exclusive */
+    uint8_t input_type;
+} read_hole_t;
+
+typedef struct read_block {
+    uint16_t address;
+    uint16_t count;             /* Registers or bits */
+    uint8_t input_type;
+    uint32_t offset;            /* In collected registers or bits */
+} read_block_t;
+
+typedef struct read_plan {
+    read_block_t *blocks;
+    unsigned int blocks_count;
+    uint32_t *slots;            /* Indexed by metric */
+    unsigned int regs_count;
+    unsigned int bits_count;
+    size_t size;
+} read_plan_t;
+
+/* A subset of the metrics of a module, with a read plan that only covers
+ * them and the operands of the derived ones. Groups from the configuration
+ * are named and built once; ad-hoc groups selected at scrape time have no
+ * name and are freed with modules_group_free().
+ */
+#define SELECT_OPERAND      1   /* Read only as an operand of a derived metric */
+#define SELECT_EXPORTED     2
+
+typedef struct metric_group {
+    const char *name;
+    uint8_t *select;            /* Per metric, 0 or SELECT_* */
+    read_plan_t *plan;
+} metric_group_t;
+
+/* Framed protocol, compiled from frame_config_t. The start marker comes with
+ * its KMP failure table, so the parser can resynchronize one byte at a time.
+ */
+#define FRAME_MAX_REQUEST       64
+#define FRAME_MAX_MARKER        8
+#define FRAME_MAX_LENGTH        512
+
+typedef struct frame {
+    uint8_t request[FRAME_MAX_REQUEST];
+    uint8_t start[FRAME_MAX_MARKER];
+    uint8_t start_fail[FRAME_MAX_MARKER];
+    uint8_t request_len;
+    uint8_t start_len;
+    int16_t target_offset;      /* -1 if none */
+    uint16_t length;            /* 0 if read from the length field */
+    uint16_t length_offset;
+    uint8_t length_size;
+    uint8_t checksum;
+    int16_t length_adjust;
+    uint16_t timeout;           /* ms */
+    uint16_t byte_timeout;      /* ms */
+} frame_t;
+
+/* A device class is a collection of metrics, stored inline in the metrics
+ * array of the owning modules_t.
+ */
 typedef struct module {
-    char *name;
+    const char *name;
     module_type_t module_type;
-    metric_t **metrics;
+    metric_t *metrics;
     unsigned int metrics_count;
+    unsigned int max_read_gap;
+    read_plan_t *plan;
+    metric_group_t *groups;
+    unsigned int groups_count;
+    const frame_t *frame;       /* Framed and TBB inverter modules */
+    float *deadbands;           /* Per metric, NULL if no metric has a deadband */
 } module_t;
 
+/* Derived metric expressions are compiled to a flat array of stack machine
+ * operations.
+ */
+#define EXPR_MAX_OPS        64
+#define EXPR_STACK_SIZE     16
+
+typedef enum expr_opcode {
+    EXPR_OP_CONST,
+    EXPR_OP_METRIC,
+    EXPR_OP_NEG,
+    EXPR_OP_ABS,
+    EXPR_OP_ADD,
+    EXPR_OP_SUB,
+    EXPR_OP_MUL,
+    EXPR_OP_DIV,
+    EXPR_OP_MIN,
+    EXPR_OP_MAX
+} expr_opcode_t;
+
+typedef struct expr_op {
+    uint16_t opcode;
+    uint16_t metric;            /* Metric index in module, for EXPR_OP_METRIC */
+    float constant;             /* For EXPR_OP_CONST */
+} expr_op_t;
+
+typedef struct expr {
+    const char *source;
+    expr_op_t *code;
+    unsigned int code_len;
+} expr_t;
+
+typedef struct poll {
+    module_t *module;
+    unsigned int target;
+    unsigned int interval;      /* Seconds */
+} poll_t;
+
+/* Run-time configuration. Everything lives in a single read-only allocation:
+ * modules, metrics, polls, fleet members, compiled expressions, bitfields,
+ * frames, groups and their selections, the module name hash index, deadbands
+ * and the string table. Read plans are allocated separately.
+ */
 typedef struct modules {
-    module_t **modules;
+    module_t *modules;
     unsigned int modules_count;
+    metric_t *metrics;
+    unsigned int metrics_count;
+    poll_t *polls;
+    unsigned int polls_count;
+    poll_t *fleet;              /* Fleet members, all with the fleet interval */
+    unsigned int fleet_count;
+    expr_t *exprs;
+    unsigned int exprs_count;
+    expr_op_t *code;
+    unsigned int code_len;
+    bitfield_t *bitfields;
+    unsigned int bitfields_count;
+    const char **bit_names;
+    unsigned int bit_names_count;
+    frame_t *frames;
+    unsigned int frames_count;
+    metric_group_t *groups;
+    unsigned int groups_count;
+    uint32_t *index;            /* Module name hash index, stores index + 1 */
+    unsigned int index_size;    /* Always a power of two */
+    float *deadbands;
+    unsigned int deadbands_count;
+    const char *strings;
+    size_t strings_len;
+    size_t mem_size;            /* Total bytes allocated */
 } modules_t;
 
 typedef union metric_value {
@@ -101,11 +363,31 @@ typedef union metric_value {
     float float_value;
 } metric_value_t;
 
+/* Collected values. Values of metrics that failed to read are not valid,
+ * and are not exported.
+ */
 typedef struct metrics_value_set {
     metric_value_t *values;
+    uint8_t *valid;
     unsigned int values_count;
+    unsigned int errors;        /* Failed reads */
+    int64_t timestamp;          /* Collection time, ms since the epoch */
 } metrics_value_set_t;
 
+/* Cumulative read errors of a module/target pair, by block */
+typedef struct block_errors {
+    uint64_t count;
+    uint16_t address;
+    uint8_t input_type;
+} block_errors_t;
+
+typedef struct target_stats {
+    block_errors_t *blocks;
+    unsigned int blocks_count;
+} target_stats_t;
+
+#define MAX_TARGET  247
+
 typedef struct options {
     char *config_file;
     int port;
@@ -116,34 +398,222 @@ typedef struct options {
     int data_bits;
     int stop_bits;
     int dry_run;
+    char *history_file;
+    int history_samples;
+    int history_series;
+    int error_budget;
+    int gateway_port;
+    int gateway_max_age;
+    int http_threads;
+    int probe;
+    char *probe_cache;
+    char *capture_file;
+    char *replay_file;
+    int replay_fast;
+    char *mqtt_broker;
+    char *mqtt_topic;
+    char *mqtt_client_id;
+    int mqtt_qos;
+    int mqtt_retain;
+    int mqtt_queue;
+    char *textfile_dir;
+    char *unix_socket;
 } options_t;
 
 #define TBB_PAYLOAD_SIZE    142
 typedef struct tbb_payload {
-    char data[TBB_PAYLOAD_SIZE];
+    uint8_t data[TBB_PAYLOAD_SIZE];
 } tbb_payload_t;
 
 typedef struct _modbus modbus_t;
+typedef struct history history_t;
+typedef struct gateway gateway_t;
+typedef struct capture capture_t;
+typedef struct snapshots snapshots_t;
+typedef struct workers workers_t;
+typedef struct probe probe_t;
+typedef struct streams streams_t;
+typedef struct fleet fleet_t;
+typedef struct mqtt mqtt_t;
 
 typedef struct exporter {
     modbus_t *modbus;
     modules_t *modules;
+    history_t *history;
+    gateway_t *gateway;
+    snapshots_t *snapshots;
+    streams_t *streams;
+    fleet_t *fleet;
+    workers_t *workers;         /* HTTP worker threads, NULL if HTTP runs on the bus thread */
+    probe_t *probe;
+    capture_t *capture;         /* Recording or replaying bus exchanges */
+    mqtt_t *mqtt;               /* Publishing every collection */
+    target_stats_t *stats;      /* Indexed by module * (MAX_TARGET + 1) + target */
     options_t options;
 } exporter_t;
 
+/* Bus exchanges, as recorded by --capture. The io function performs an
+ * exchange and returns the response length, or -1 with errno set.
+ */
+typedef enum capture_kind {
+    CAPTURE_MODBUS,             /* Raw request (without CRC) and confirmation */
+    CAPTURE_FRAME               /* Request and received frame */
+} capture_kind_t;
+
+typedef int (*capture_io_fn)(exporter_t *exporter, void *ctx, const uint8_t *req, size_t req_len,
+                             uint8_t *rsp);
+
+/* One fleet snapshot: the values of every fleet member (NULL if collecting
+ * it failed), all collected within start..end (ms).
+ */
+typedef struct fleet_set {
+    uint64_t generation;
+    int64_t start;
+    int64_t end;
+    metrics_value_set_t *values[];
+} fleet_set_t;
+
+/* A collection handed to the bus thread by an HTTP worker. The done callback
+ * runs on the worker thread, unless the client has disconnected by then.
+ */
+typedef struct collect_job collect_job_t;
+typedef void (*collect_done_fn)(collect_job_t *job);
+
+struct collect_job {
+    exporter_t *exporter;
+    module_t *module;
+    int target;
+    struct evhttp_request *req;
+    metric_group_t *group;      /* NULL for all metrics, ad-hoc groups are freed with the job */
+    metrics_value_set_t *values;
+    collect_done_fn done;
+    struct event_base *base;
+    int cancelled;
+};
+
 /* modules.c */
 module_t *modules_get_module(modules_t *modules, const char *name);
 modules_t *modules_load(const char *filename);
+void modules_free(modules_t *modules);
 int modules_dump(modules_t *modules, char **output, size_t *len);
 const char *get_metric_type_str(metric_type_t metric_type);
+const char *get_input_type_str(input_type_t input_type);
+int get_input_type(const char *str);
+const bitfield_t *modules_get_bitfield(modules_t *modules, const metric_t *metric);
+metric_group_t *modules_get_group(module_t *module, const char *name);
+metric_group_t *modules_group_new(module_t *module);
+int modules_group_add(module_t *module, metric_group_t *group, const char *name);
+int modules_group_build(modules_t *modules, module_t *module, metric_group_t *group);
+void modules_group_free(metric_group_t *group);
+
+/* plan.c */
+read_plan_t *read_plan_build(module_t *module, const uint8_t *select, unsigned int max_gap,
+                             const read_hole_t *holes, unsigned int holes_count);
+void read_plan_free(read_plan_t *plan);
 
 /* collect.c */
-metrics_value_set_t *metrics_value_set_collect(exporter_t *exporter, module_t *module, int target);
+metrics_value_set_t *metrics_value_set_collect(exporter_t *exporter, module_t *module, int target,
+                                               const metric_group_t *group);
 void metrics_value_set_free(metrics_value_set_t *values);
+block_errors_t *collect_get_block_errors(exporter_t *exporter, module_t *module, int target,
+                                         unsigned int *count);
+void unpack_bits(const uint8_t *packed, unsigned int count, uint8_t *bits);
+int collect_transact(exporter_t *exporter, const uint8_t *req, size_t req_len, uint8_t *rsp);
+int collect_read_block(exporter_t *exporter, int target, read_block_t *block,
+                       uint16_t *regs, uint8_t *bits);
+void collect_record(exporter_t *exporter, module_t *module, int target,
+                    metrics_value_set_t *values);
+
+/* expr.c */
+typedef int (*expr_resolve_fn)(void *ctx, const char *name, size_t len);
+
+double metric_value_get_double(const metric_t *metric, const metric_value_t *value);
+int expr_compile(const char *source, expr_resolve_fn resolve, void *resolve_ctx,
+                 expr_op_t *code, unsigned int *len, char *err, size_t err_len);
+double expr_eval(const expr_op_t *code, unsigned int len,
+                 const metric_t *metrics, const metric_value_t *values);
 
 /* http.c */
+struct evhttp *http_new(exporter_t *exporter, struct event_base *base);
 void handle_config(struct evhttp_request *req, void *arg);
 void handle_metrics(struct evhttp_request *req, void *arg);
+void handle_history(struct evhttp_request *req, void *arg);
+void handle_stream(struct evhttp_request *req, void *arg);
+void handle_fleet(struct evhttp_request *req, void *arg);
+int http_bind_unix(struct evhttp *http, struct event_base *base, const char *path);
+struct evbuffer *render_metrics(exporter_t *exporter, module_t *module, int target,
+                                const metric_group_t *group, metrics_value_set_t *vals,
+                                const char *labels);
+
+/* fleet.c */
+fleet_t *fleet_start(exporter_t *exporter, struct event_base *base);
+const fleet_set_t *fleet_acquire(fleet_t *fleet);
+void fleet_release(fleet_t *fleet);
+
+/* poll.c */
+int poll_start(exporter_t *exporter, struct event_base *base);
+
+/* snapshot.c */
+snapshots_t *snapshots_create(modules_t *modules);
+void snapshots_free(snapshots_t *snapshots);
+void snapshots_publish(snapshots_t *snapshots, module_t *module, int target,
+                       metrics_value_set_t *values);
+metrics_value_set_t *snapshots_read(snapshots_t *snapshots, module_t *module, int target);
+
+/* stream.c */
+streams_t *streams_create(exporter_t *exporter);
+void streams_publish(streams_t *streams, poll_t *poll, metrics_value_set_t *values);
+int streams_subscribe(streams_t *streams, struct evhttp_request *req, poll_t *poll);
+int streams_render_json(struct evbuffer *buf, module_t *module, metrics_value_set_t *values,
+                        const uint8_t *select);
+
+/* probe.c */
+probe_t *probe_open(exporter_t *exporter, const char *cache_file);
+read_plan_t *probe_get_plan(exporter_t *exporter, module_t *module, int target,
+                            const metric_group_t *group, int *temporary);
+void probe_invalidate(exporter_t *exporter, module_t *module, int target);
+
+/* workers.c */
+int workers_start(exporter_t *exporter, struct event_base *bus_base);
+int workers_collect(exporter_t *exporter, struct evhttp_request *req, module_t *module,
+                    int target, metric_group_t *group, collect_done_fn done);
+
+/* gateway.c */
+gateway_t *gateway_start(exporter_t *exporter, struct event_base *base);
+void gateway_cache_store(gateway_t *gateway, int unit, int function, int address, int count,
+                         const uint8_t *data);
+
+/* history.c */
+history_t *history_open(const char *filename, unsigned int samples, unsigned int series);
+void history_close(history_t *history);
+void history_record(history_t *history, module_t *module, int target, metrics_value_set_t *values);
+int history_render(history_t *history, module_t *module, int target, const char *metric_name,
+                   int delta, struct evbuffer *buf);
+
+/* frame.c */
+extern const frame_t tbb_frame;
+
+uint16_t frame_crc16(const uint8_t *data, size_t len);
+int frame_compile(const frame_config_t *config, frame_t *frame, char *err, size_t err_len);
+void frame_to_config(const frame_t *frame, frame_config_t *config, unsigned int *request,
+                     unsigned int *start, unsigned int *target_offset,
+                     length_field_config_t *length_field);
+int frame_transact(exporter_t *exporter, const frame_t *frame, int target,
+                   uint8_t *buf, size_t *len);
+
+/* capture.c */
+capture_t *capture_open(const char *filename, int replay, int fast);
+void capture_close(capture_t *capture);
+int capture_transact(exporter_t *exporter, int kind, const uint8_t *req, size_t req_len,
+                     uint8_t *rsp, size_t rsp_size, capture_io_fn io, void *ctx);
+
+/* mqtt.c */
+mqtt_t *mqtt_open(struct event_base *base, const char *broker, const char *client_id,
+                  int qos, int retain, unsigned int queue_max);
+int mqtt_publish(mqtt_t *mqtt, const char *topic, const void *payload, size_t len);
+
+/* textfile.c */
+int textfile_write(exporter_t *exporter, module_t *module, int target, metrics_value_set_t *values);
 
 /* tbb_inverter.c */
 int tbb_get_payload(exporter_t *exporter, tbb_payload_t *payload);
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "exporter485.h"
+
+/* Derived metric expressions.
+ *
+ * Expressions are compiled once, when the configuration is loaded, into a
+ * flat array of stack machine operations. Evaluating an expression is then a
+ * single pass over the array, with no parsing or name lookups.
+ *
+ * Grammar:
+ *   expr    := term (('+' | '-') term)*
+ *   term    := unary (('*' | '/') unary)*
+ *   unary   := '-' unary | primary
+ *   primary := number | metric | func '(' expr (',' expr)* ')' | '(' expr ')'
+ *   func    := 'abs' | 'min' | 'max'
+ */
+
+/* Parentheses, function calls and unary minus recurse, and are limited so
+ * that a hostile expression can not exhaust the stack.
+ */
+#define EXPR_MAX_NESTING    32
+
+typedef struct expr_parser {
+    const char *p;
+    expr_op_t *code;
+    unsigned int len;
+    int depth;
+    int max_depth;
+    int nesting;
+    expr_resolve_fn resolve;
+    void *resolve_ctx;
+    char *err;
+    size_t err_len;
+} expr_parser_t;
+
+double metric_value_get_double(const metric_t *metric, const metric_value_t *value)
+{
+    switch (metric->data_type) {
+        case DATA_TYPE_FLOAT16:
+        case DATA_TYPE_FLOAT32:
+            return value->float_value;
+        case DATA_TYPE_INT16:
+        case DATA_TYPE_INT32:
+            return value->int_value;
+        default:
+            return value->uint_value;
+    }
+}
+
+static int parse_expr(expr_parser_t *parser);
+
+static void skip_space(expr_parser_t *parser)
+{
+    while (isspace((unsigned char) *parser->p))
+        parser->p++;
+}
+
+static int emit(expr_parser_t *parser, expr_opcode_t opcode, unsigned int metric, float constant)
+{
+    if (parser->len == EXPR_MAX_OPS) {
+        snprintf(parser->err, parser->err_len, "expression too long");
+        return -1;
+    }
+
+    switch (opcode) {
+        case EXPR_OP_CONST:
+        case EXPR_OP_METRIC:
+            parser->depth++;
+            break;
+        case EXPR_OP_NEG:
+        case EXPR_OP_ABS:
+            break;
+        default:
+            parser->depth--;
+            break;
+    }
+    if (parser->depth > parser->max_depth)
+        parser->max_depth = parser->depth;
+    if (parser->max_depth > EXPR_STACK_SIZE) {
+        snprintf(parser->err, parser->err_len, "expression too complex");
+        return -1;
+    }
+
+    expr_op_t *op = &parser->code[parser->len++];
+    op->opcode = opcode;
+    op->metric = metric;
+    op->constant = constant;
+
+    return 0;
+}
+
+static int nest(expr_parser_t *parser)
+{
+    if (++parser->nesting > EXPR_MAX_NESTING) {
+        snprintf(parser->err, parser->err_len, "expression nested too deeply");
+        return -1;
+    }
+    return 0;
+}
+
+static int expect(expr_parser_t *parser, char c)
+{
+    skip_space(parser);
+    if (*parser->p != c) {
+        snprintf(parser->err, parser->err_len, "expected '%c' at '%s'", c, parser->p);
+        return -1;
+    }
+    parser->p++;
+    return 0;
+}
+
+static int parse_function(expr_parser_t *parser, const char *name, size_t len)
+{
+    static const struct {
+        const char *name;
+        expr_opcode_t opcode;
+        int variadic;
+    } functions[] = {
+        { "abs", EXPR_OP_ABS, 0 },
+        { "min", EXPR_OP_MIN, 1 },
+        { "max", EXPR_OP_MAX, 1 }
+    };
+
+    for (int i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (strlen(functions[i].name) != len || strncmp(functions[i].name, name, len) != 0)
+            continue;
+
+        parser->p++;    /* '(' */
+        if (parse_expr(parser) < 0)
+            return -1;
+
+        skip_space(parser);
+        if (functions[i].variadic) {
+            int args = 1;
+            while (*parser->p == ',') {
+                parser->p++;
+                if (parse_expr(parser) < 0 || emit(parser, functions[i].opcode, 0, 0) < 0)
+                    return -1;
+                args++;
+                skip_space(parser);
+            }
+            if (args < 2) {
+                snprintf(parser->err, parser->err_len, "%s() needs at least two arguments",
+                         functions[i].name);
+                return -1;
+            }
+        } else if (emit(parser, functions[i].opcode, 0, 0) < 0) {
+            return -1;
+        }
+
+        return expect(parser, ')');
+    }
+
+    snprintf(parser->err, parser->err_len, "unknown function '%.*s'", (int) len, name);
+    return -1;
+}
+
+static int parse_primary(expr_parser_t *parser)
+{
+    skip_space(parser);
+
+    const char *start = parser->p;
+    if (*start == '(') {
+        parser->p++;
+        if (parse_expr(parser) < 0)
+            return -1;
+        return expect(parser, ')');
+    }
+
+    if (isdigit((unsigned char) *start) || *start == '.') {
+        char *end;
+        float constant = strtof(start, &end);
+        if (end == start) {
+            snprintf(parser->err, parser->err_len, "invalid number at '%s'", start);
+            return -1;
+        }
+        parser->p = end;
+        return emit(parser, EXPR_OP_CONST, 0, constant);
+    }
+
+    if (isalpha((unsigned char) *start) || *start == '_') {
+        while (isalnum((unsigned char) *parser->p) || *parser->p == '_')
+            parser->p++;
+
+        size_t len = parser->p - start;
+        skip_space(parser);
+        if (*parser->p == '(')
+            return parse_function(parser, start, len);
+
+        int metric = parser->resolve(parser->resolve_ctx, start, len);
+        if (metric < 0) {
+            snprintf(parser->err, parser->err_len, "unknown or invalid metric '%.*s'",
+                     (int) len, start);
+            return -1;
+        }
+        return emit(parser, EXPR_OP_METRIC, metric, 0);
+    }
+
+    snprintf(parser->err, parser->err_len, "unexpected '%s'", *start ? start : "end of expression");
+    return -1;
+}
+
+static int parse_unary(expr_parser_t *parser)
+{
+    skip_space(parser);
+    if (*parser->p == '-') {
+        parser->p++;
+        if (nest(parser) < 0 || parse_unary(parser) < 0)
+            return -1;
+        parser->nesting--;
+        return emit(parser, EXPR_OP_NEG, 0, 0);
+    }
+
+    return parse_primary(parser);
+}
+
+static int parse_term(expr_parser_t *parser)
+{
+    if (parse_unary(parser) < 0)
+        return -1;
+
+    while (1) {
+        skip_space(parser);
+
+        expr_opcode_t opcode;
+        if (*parser->p == '*')
+            opcode = EXPR_OP_MUL;
+        else if (*parser->p == '/')
+            opcode = EXPR_OP_DIV;
+        else
+            return 0;
+
+        parser->p++;
+        if (parse_unary(parser) < 0 || emit(parser, opcode, 0, 0) < 0)
+            return -1;
+    }
+}
+
+/* Every parenthesized expression and function argument is parsed here */
+static int parse_expr(expr_parser_t *parser)
+{
+    if (nest(parser) < 0 || parse_term(parser) < 0)
+        return -1;
+
+    while (1) {
+        skip_space(parser);
+
+        expr_opcode_t opcode;
+        if (*parser->p == '+')
+            opcode = EXPR_OP_ADD;
+        else if (*parser->p == '-')
+            opcode = EXPR_OP_SUB;
+        else
+            break;
+
+        parser->p++;
+        if (parse_term(parser) < 0 || emit(parser, opcode, 0, 0) < 0)
+            return -1;
+    }
+
+    parser->nesting--;
+    return 0;
+}
+
+int expr_compile(const char *source, expr_resolve_fn resolve, void *resolve_ctx,
+                 expr_op_t *code, unsigned int *len, char *err, size_t err_len)
+{
+    expr_parser_t parser = {
+        .p = source,
+        .code = code,
+        .resolve = resolve,
+        .resolve_ctx = resolve_ctx,
+        .err = err,
+        .err_len = err_len
+    };
+
+    if (parse_expr(&parser) < 0)
+        return -1;
+
+    skip_space(&parser);
+    if (*parser.p) {
+        snprintf(err, err_len, "unexpected '%s'", parser.p);
+        return -1;
+    }
+
+    *len = parser.len;
+    return 0;
+}
+
+double expr_eval(const expr_op_t *code, unsigned int len,
+                 const metric_t *metrics, const metric_value_t *values)
+{
+    double stack[EXPR_STACK_SIZE];
+    int sp = 0;
+
+    for (const expr_op_t *op = code; op < code + len; op++) {
+        switch (op->opcode) {
+            case EXPR_OP_CONST:
+                stack[sp++] = op->constant;
+                break;
+            case EXPR_OP_METRIC:
+                stack[sp++] = metric_value_get_double(&metrics[op->metric], &values[op->metric]);
+                break;
+            case EXPR_OP_NEG:
+                stack[sp - 1] = -stack[sp - 1];
+                break;
+            case EXPR_OP_ABS:
+                stack[sp - 1] = fabs(stack[sp - 1]);
+                break;
+            case EXPR_OP_ADD:
+                sp--;
+                stack[sp - 1] += stack[sp];
+                break;
+            case EXPR_OP_SUB:
+                sp--;
+                stack[sp - 1] -= stack[sp];
+                break;
+            case EXPR_OP_MUL:
+                sp--;
+                stack[sp - 1] *= stack[sp];
+                break;
+            case EXPR_OP_DIV:
+                sp--;
+                stack[sp - 1] = stack[sp] != 0 ? stack[sp - 1] / stack[sp] : NAN;
+                break;
+            case EXPR_OP_MIN:
+                sp--;
+                stack[sp - 1] = fmin(stack[sp - 1], stack[sp]);
+                break;
+            case EXPR_OP_MAX:
+                sp--;
+                stack[sp - 1] = fmax(stack[sp - 1], stack[sp]);
+                break;
+        }
+    }
+
+    return sp ? stack[0] : NAN;
+}
+
+#ifdef TEST
+static const char *test_metrics[] = { "pv_voltage", "pv_current", "battery_current", "load_current" };
+
+static int test_resolve(void *ctx, const char *name, size_t len)
+{
+    for (int i = 0; i < sizeof(test_metrics) / sizeof(test_metrics[0]); i++) {
+        if (strlen(test_metrics[i]) == len && !strncmp(test_metrics[i], name, len))
+            return i;
+    }
+    return -1;
+}
+
+static int test_expr(const char *source, double expected)
+{
+    static const metric_t metrics[] = {
+        { .name = "pv_voltage", .data_type = DATA_TYPE_FLOAT16 },
+        { .name = "pv_current", .data_type = DATA_TYPE_FLOAT16 },
+        { .name = "battery_current", .data_type = DATA_TYPE_INT16 },
+        { .name = "load_current", .data_type = DATA_TYPE_UINT16 }
+    };
+    metric_value_t values[4];
+    values[0].float_value = 24.5f;
+    values[1].float_value = 2.0f;
+    values[2].int_value = -3;
+    values[3].uint_value = 5;
+
+    expr_op_t code[EXPR_MAX_OPS];
+    unsigned int len;
+    char err[128];
+
+    if (expr_compile(source, test_resolve, NULL, code, &len, err, sizeof(err)) < 0) {
+        printf("%s: compile failed: %s\n", source, err);
+        return 0;
+    }
+
+    double result = expr_eval(code, len, metrics, values);
+    printf("%s = %g\n", source, result);
+    return fabs(result - expected) < 1e-6 || (isnan(expected) && isnan(result));
+}
+
+static int test_invalid(const char *source)
+{
+    expr_op_t code[EXPR_MAX_OPS];
+    unsigned int len;
+    char err[128];
+
+    int ret = expr_compile(source, test_resolve, NULL, code, &len, err, sizeof(err));
+    printf("%s: %s\n", source, ret < 0 ? err : "compiled");
+    return ret < 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (!test_expr("pv_voltage * pv_current", 49)) exit(1);
+    if (!test_expr("battery_current - load_current", -8)) exit(1);
+    if (!test_expr("-(pv_current + 1) * 2 / 4", -1.5)) exit(1);
+    if (!test_expr("abs(battery_current) + max(1, load_current, 3)", 8)) exit(1);
+    if (!test_expr("min(pv_current, 0.5)", 0.5)) exit(1);
+    if (!test_expr("pv_voltage / (load_current - 5)", NAN)) exit(1);
+    if (!test_invalid("pv_voltage *")) exit(1);
+    if (!test_invalid("unknown_metric + 1")) exit(1);
+    if (!test_invalid("min(1)")) exit(1);
+    if (!test_invalid("(1 + 2")) exit(1);
+    if (!test_invalid("1 2")) exit(1);
+    if (!test_invalid("sqrt(4)")) exit(1);
+
+    /* Deep nesting is rejected rather than recursed into */
+    char deep[1024];
+    memset(deep, '(', sizeof(deep) - 1);
+    deep[sizeof(deep) - 1] = '\0';
+    if (!test_invalid(deep)) exit(1);
+    memset(deep, '-', sizeof(deep) - 1);
+    if (!test_invalid(deep)) exit(1);
+    if (!test_expr("((((-(-pv_current)))))", 2)) exit(1);
+
+    exit(0);
+}
+#endif
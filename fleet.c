@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <event2/event.h>
+#include "exporter485.h"
+
+/* Fleet snapshots: the configured module/target pairs are collected back to
+ * back in a single bus thread callback, so no scrape, poll or gateway request
+ * is interleaved and the readings are as close together as the bus allows.
+ * Collections start on multiples of the interval, so sets taken by exporters
+ * on different sites line up too. The latest complete set is published as a
+ * whole, and replaced only once the next one is complete.
+ */
+struct fleet {
+    exporter_t *exporter;
+    struct event *ev;
+    unsigned int interval;      /* Seconds */
+    uint64_t generation;
+    pthread_mutex_t lock;       /* Protects latest */
+    fleet_set_t *latest;
+};
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void set_free(fleet_set_t *set, unsigned int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (set->values[i])
+            metrics_value_set_free(set->values[i]);
+    }
+    free(set);
+}
+
+static void schedule(fleet_t *fleet)
+{
+    int64_t period = fleet->interval * 1000;
+    int64_t delay = period - now_ms() % period;
+    struct timeval tv = { .tv_sec = delay / 1000, .tv_usec = (delay % 1000) * 1000 };
+
+    event_add(fleet->ev, &tv);
+}
+
+static void fleet_cb(evutil_socket_t fd, short what, void *arg)
+{
+    fleet_t *fleet = (fleet_t *) arg;
+    exporter_t *exporter = fleet->exporter;
+    modules_t *modules = exporter->modules;
+
+    schedule(fleet);
+
+    fleet_set_t *set = calloc(1, sizeof(fleet_set_t) + modules->fleet_count * sizeof(metrics_value_set_t *));
+    if (!set) {
+        fprintf(stderr, "Failed to allocate fleet snapshot\n");
+        return;
+    }
+
+    set->start = now_ms();
+    for (int i = 0; i < modules->fleet_count; i++) {
+        poll_t *member = &modules->fleet[i];
+        set->values[i] = metrics_value_set_collect(exporter, member->module, member->target, NULL);
+    }
+    set->end = now_ms();
+    set->generation = ++fleet->generation;
+
+    /* Only once the set is complete, to keep collections back to back */
+    for (int i = 0; i < modules->fleet_count; i++) {
+        if (set->values[i])
+            collect_record(exporter, modules->fleet[i].module, modules->fleet[i].target, set->values[i]);
+    }
+
+    pthread_mutex_lock(&fleet->lock);
+    fleet_set_t *prev = fleet->latest;
+    fleet->latest = set;
+    pthread_mutex_unlock(&fleet->lock);
+
+    if (prev)
+        set_free(prev, modules->fleet_count);
+}
+
+fleet_t *fleet_start(exporter_t *exporter, struct event_base *base)
+{
+    fleet_t *fleet = calloc(1, sizeof(fleet_t));
+    if (!fleet)
+        return NULL;
+
+    fleet->exporter = exporter;
+    fleet->interval = exporter->modules->fleet[0].interval;
+    pthread_mutex_init(&fleet->lock, NULL);
+    if (!(fleet->ev = evtimer_new(base, fleet_cb, fleet))) {
+        fprintf(stderr, "Failed to schedule fleet snapshots.\n");
+        free(fleet);
+        return NULL;
+    }
+
+    schedule(fleet);
+    return fleet;
+}
+
+/* Returns the latest set, or NULL if none is complete yet. The set remains
+ * valid until fleet_release() is called.
+ */
+const fleet_set_t *fleet_acquire(fleet_t *fleet)
+{
+    pthread_mutex_lock(&fleet->lock);
+    return fleet->latest;
+}
+
+void fleet_release(fleet_t *fleet)
+{
+    pthread_mutex_unlock(&fleet->lock);
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <modbus/modbus.h>
+#include "exporter485.h"
+
+/* Framed protocols, for devices that answer a fixed request with a single
+ * frame rather than speaking Modbus.
+ */
+
+#define FRAME_DEFAULT_TIMEOUT   500     /* ms */
+
+/* The TBB inverter protocol */
+const frame_t tbb_frame = {
+    .request = { 0x7e, 0xff, 0x11, 0x03, 0xa0, 0x08, 0x92, 0xeb },
+    .request_len = 8,
+    .target_offset = -1,
+    .length = TBB_PAYLOAD_SIZE,
+    .checksum = CHECKSUM_CRC16,
+    .timeout = FRAME_DEFAULT_TIMEOUT,
+    .byte_timeout = FRAME_DEFAULT_TIMEOUT
+};
+
+uint16_t frame_crc16(const uint8_t *data, size_t len)
+{
+    static const uint16_t crc_table[] = {
+            0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+            0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+            0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+            0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+            0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+            0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+            0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+            0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+            0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+            0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+            0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+            0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+            0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+            0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+            0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+            0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+            0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+            0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+            0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+            0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+            0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+            0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+            0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+            0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+            0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+            0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+            0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+            0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+            0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+            0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+            0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+            0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040};
+
+    uint8_t xor = 0;
+    uint16_t crc = 0xffff;
+
+    while (len--) {
+        xor = (*data++) ^ crc;
+        crc >>= 8;
+        crc ^= crc_table[xor];
+    }
+
+    return crc;
+}
+
+static unsigned int checksum_size(int checksum)
+{
+    switch (checksum) {
+        case CHECKSUM_CRC16:
+            return 2;
+        case CHECKSUM_SUM8:
+        case CHECKSUM_XOR8:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Computes the checksum of the bytes preceding it, and stores or verifies it */
+static int checksum_apply(int checksum, uint8_t *data, size_t len, int store)
+{
+    size_t n = len - checksum_size(checksum);
+    uint8_t sum[2] = { 0, 0 };
+
+    switch (checksum) {
+        case CHECKSUM_CRC16: {
+            uint16_t crc = frame_crc16(data, n);
+            sum[0] = crc & 0xff;
+            sum[1] = crc >> 8;
+            break;
+        }
+        case CHECKSUM_SUM8:
+            for (size_t i = 0; i < n; i++)
+                sum[0] += data[i];
+            break;
+        case CHECKSUM_XOR8:
+            for (size_t i = 0; i < n; i++)
+                sum[0] ^= data[i];
+            break;
+        default:
+            return 1;
+    }
+
+    if (store) {
+        memcpy(data + n, sum, checksum_size(checksum));
+        return 1;
+    }
+    return !memcmp(data + n, sum, checksum_size(checksum));
+}
+
+int frame_compile(const frame_config_t *c, frame_t *frame, char *err, size_t err_len)
+{
+    unsigned int csize = checksum_size(c->checksum);
+
+    memset(frame, 0, sizeof(frame_t));
+    if (!c->request_count || c->request_count > FRAME_MAX_REQUEST) {
+        snprintf(err, err_len, "request must be 1-%d bytes", FRAME_MAX_REQUEST);
+        return -1;
+    }
+    if (c->start_count > FRAME_MAX_MARKER) {
+        snprintf(err, err_len, "start marker is limited to %d bytes", FRAME_MAX_MARKER);
+        return -1;
+    }
+    for (int i = 0; i < c->request_count; i++) {
+        if (c->request[i] > 0xff) {
+            snprintf(err, err_len, "invalid request byte %u", c->request[i]);
+            return -1;
+        }
+        frame->request[i] = c->request[i];
+    }
+    for (int i = 0; i < c->start_count; i++) {
+        if (c->start[i] > 0xff) {
+            snprintf(err, err_len, "invalid start marker byte %u", c->start[i]);
+            return -1;
+        }
+        frame->start[i] = c->start[i];
+    }
+    frame->request_len = c->request_count;
+    frame->start_len = c->start_count;
+
+    /* The request checksum is recomputed once the target is set */
+    frame->target_offset = -1;
+    if (c->target_offset) {
+        if (*c->target_offset + csize >= c->request_count) {
+            snprintf(err, err_len, "target offset %u is outside the request", *c->target_offset);
+            return -1;
+        }
+        frame->target_offset = *c->target_offset;
+    }
+
+    if ((c->length != 0) == (c->length_field != NULL)) {
+        snprintf(err, err_len, "exactly one of length and lengthField is required");
+        return -1;
+    }
+    if (c->length) {
+        if (c->length > FRAME_MAX_LENGTH || c->length < c->start_count + csize) {
+            snprintf(err, err_len, "invalid length %u", c->length);
+            return -1;
+        }
+        frame->length = c->length;
+    } else {
+        length_field_config_t *lf = c->length_field;
+        if ((lf->size != 1 && lf->size != 2) || lf->offset < c->start_count ||
+            lf->offset + lf->size > FRAME_MAX_LENGTH) {
+            snprintf(err, err_len, "invalid length field");
+            return -1;
+        }
+        frame->length_offset = lf->offset;
+        frame->length_size = lf->size;
+        frame->length_adjust = lf->adjust;
+    }
+
+    frame->checksum = c->checksum;
+    frame->timeout = c->timeout ? c->timeout : FRAME_DEFAULT_TIMEOUT;
+    frame->byte_timeout = c->byte_timeout ? c->byte_timeout : FRAME_DEFAULT_TIMEOUT;
+
+    for (int i = 1, k = 0; i < frame->start_len; i++) {
+        while (k > 0 && frame->start[i] != frame->start[k])
+            k = frame->start_fail[k - 1];
+        if (frame->start[i] == frame->start[k])
+            k++;
+        frame->start_fail[i] = k;
+    }
+
+    return 0;
+}
+
+/* Fills in a configuration, using the provided arrays, for dumping */
+void frame_to_config(const frame_t *frame, frame_config_t *config, unsigned int *request,
+                     unsigned int *start, unsigned int *target_offset,
+                     length_field_config_t *length_field)
+{
+    memset(config, 0, sizeof(frame_config_t));
+    for (int i = 0; i < frame->request_len; i++)
+        request[i] = frame->request[i];
+    for (int i = 0; i < frame->start_len; i++)
+        start[i] = frame->start[i];
+
+    config->request = request;
+    config->request_count = frame->request_len;
+    config->start = frame->start_len ? start : NULL;
+    config->start_count = frame->start_len;
+    if (frame->target_offset >= 0) {
+        *target_offset = frame->target_offset;
+        config->target_offset = target_offset;
+    }
+    if (frame->length) {
+        config->length = frame->length;
+    } else {
+        length_field->offset = frame->length_offset;
+        length_field->size = frame->length_size;
+        length_field->adjust = frame->length_adjust;
+        config->length_field = length_field;
+    }
+    config->checksum = frame->checksum;
+    config->timeout = frame->timeout;
+    config->byte_timeout = frame->byte_timeout;
+}
+
+/* Streaming frame parser, fed one byte at a time */
+typedef struct frame_parser {
+    const frame_t *frame;
+    uint8_t *buf;
+    size_t len;
+    size_t need;                /* Frame length, once known */
+} frame_parser_t;
+
+/* Returns 1 once a frame is complete, 0 if more bytes are needed or -1 if
+ * the length field is invalid.
+ */
+static int parser_feed(frame_parser_t *p, uint8_t c)
+{
+    const frame_t *f = p->frame;
+
+    if (p->len < f->start_len) {
+        while (p->len > 0 && c != f->start[p->len])
+            p->len = f->start_fail[p->len - 1];
+        if (c == f->start[p->len])
+            p->buf[p->len++] = c;
+        return 0;
+    }
+
+    p->buf[p->len++] = c;
+    if (!p->need) {
+        if (f->length) {
+            p->need = f->length;
+        } else if (p->len == f->length_offset + f->length_size) {
+            int need = p->buf[f->length_offset];
+            if (f->length_size == 2)
+                need = need << 8 | p->buf[f->length_offset + 1];
+            need += f->length_adjust;
+            if (need < (int) p->len || need < (int) (f->start_len + checksum_size(f->checksum)) ||
+                need > FRAME_MAX_LENGTH)
+                return -1;
+            p->need = need;
+        }
+    }
+
+    return p->need && p->len == p->need;
+}
+
+static int wait_readable(int fd, unsigned int timeout_ms)
+{
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    fd_set rset;
+
+    FD_ZERO(&rset);
+    FD_SET(fd, &rset);
+
+    int ret = select(fd + 1, &rset, NULL, NULL, &tv);
+    if (ret == 0)
+        errno = ETIMEDOUT;
+    return ret > 0 ? 0 : -1;
+}
+
+static int frame_io(exporter_t *exporter, void *ctx, const uint8_t *request, size_t request_len,
+                    uint8_t *buf)
+{
+    const frame_t *frame = (const frame_t *) ctx;
+    int fd = modbus_get_socket(exporter->modbus);
+
+    modbus_flush(exporter->modbus);
+    if (write(fd, request, request_len) != request_len)
+        return -1;
+
+    frame_parser_t parser = { .frame = frame, .buf = buf };
+    unsigned int timeout = frame->timeout;
+
+    while (1) {
+        uint8_t chunk[64];
+
+        if (wait_readable(fd, timeout) < 0)
+            return -1;
+
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+
+        for (ssize_t i = 0; i < n; i++) {
+            int ret = parser_feed(&parser, chunk[i]);
+            if (ret < 0) {
+                errno = EMBBADDATA;
+                return -1;
+            }
+            if (ret > 0) {
+                if (!checksum_apply(frame->checksum, buf, parser.len, 0)) {
+                    errno = EMBBADCRC;
+                    return -1;
+                }
+                return parser.len;
+            }
+        }
+
+        timeout = frame->byte_timeout;
+    }
+}
+
+/* Sends the request and receives the response frame into buf, which must
+ * hold FRAME_MAX_LENGTH bytes.
+ */
+int frame_transact(exporter_t *exporter, const frame_t *frame, int target,
+                   uint8_t *buf, size_t *len)
+{
+    uint8_t request[FRAME_MAX_REQUEST];
+
+    memcpy(request, frame->request, frame->request_len);
+    if (frame->target_offset >= 0) {
+        request[frame->target_offset] = target;
+        checksum_apply(frame->checksum, request, frame->request_len, 1);
+    }
+
+    int ret = capture_transact(exporter, CAPTURE_FRAME, request, frame->request_len, buf,
+                               FRAME_MAX_LENGTH, frame_io, (void *) frame);
+    if (ret < 0)
+        return -1;
+
+    *len = ret;
+    return 0;
+}
+
+#ifdef FRAME_TEST
+static int parse(const frame_t *frame, const uint8_t *data, size_t len, uint8_t *buf)
+{
+    frame_parser_t parser = { .frame = frame, .buf = buf };
+
+    for (size_t i = 0; i < len; i++) {
+        int ret = parser_feed(&parser, data[i]);
+        if (ret < 0)
+            return -1;
+        if (ret > 0)
+            return checksum_apply(frame->checksum, buf, parser.len, 0) ? (int) parser.len : -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int request[] = { 0x01, 0x00, 0x10, 0x00 };
+    unsigned int start[] = { 0xaa, 0xaa, 0x55 };
+    unsigned int target_offset = 1;
+    length_field_config_t length_field = { .offset = 3, .size = 1, .adjust = 5 };
+    frame_config_t config = {
+        .request = request, .request_count = 4, .target_offset = &target_offset,
+        .start = start, .start_count = 3, .length_field = &length_field,
+        .checksum = CHECKSUM_SUM8
+    };
+    frame_t frame;
+    uint8_t buf[FRAME_MAX_LENGTH];
+    char err[128];
+    int ret;
+
+    ret = frame_compile(&config, &frame, err, sizeof(err));
+    printf("frame_compile: %d\n", ret);
+    if (ret < 0) exit(1);
+
+    /* Starts with a partial marker, which must not swallow the real one */
+    const uint8_t data1[] = { 0x00, 0xaa, 0xaa, 0xaa, 0x55, 0x02, 0x12, 0x34, 0xf1 };
+    ret = parse(&frame, data1, sizeof(data1), buf);
+    printf("data1 parse: %d\n", ret);
+    if (ret != 7 || buf[4] != 0x12) exit(1);
+
+    const uint8_t bad_data1[] = { 0xaa, 0xaa, 0x55, 0x02, 0x12, 0x34, 0xf2 };
+    ret = parse(&frame, bad_data1, sizeof(bad_data1), buf);
+    printf("bad_data1 parse: %d\n", ret);
+    if (ret != -1) exit(1);
+
+    length_field.adjust = -5;
+    frame_compile(&config, &frame, err, sizeof(err));
+    const uint8_t bad_length[] = { 0xaa, 0xaa, 0x55, 0x02 };
+    ret = parse(&frame, bad_length, sizeof(bad_length), buf);
+    printf("bad_length parse: %d\n", ret);
+    if (ret != -1) exit(1);
+
+    config.length = 16;
+    ret = frame_compile(&config, &frame, err, sizeof(err));
+    printf("length and lengthField frame_compile: %d\n", ret);
+    if (ret != -1) exit(1);
+
+    /* The TBB request carries its own CRC */
+    memcpy(buf, tbb_frame.request, tbb_frame.request_len);
+    ret = checksum_apply(CHECKSUM_CRC16, buf, tbb_frame.request_len, 0);
+    printf("tbb request checksum: %d\n", ret);
+    if (!ret) exit(1);
+
+    exit(0);
+}
+#endif
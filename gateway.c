@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <modbus/modbus.h>
+#include "exporter485.h"
+
+/* Modbus TCP gateway.
+ *
+ * External Modbus TCP clients share the RS-485 bus with the exporter's own
+ * collections. Their requests are queued and executed one at a time from the
+ * event loop, so they never collide with collections on the bus. Reads are
+ * answered from recently read blocks (by either collections or other clients)
+ * when fresh enough, and identical queued reads are coalesced into a single
+ * bus request.
+ */
+
+#define MBAP_HEADER_LENGTH      7
+#define RTU_CHECKSUM_LENGTH     2
+#define GATEWAY_CACHE_SIZE      32
+#define GATEWAY_CACHE_DATA      250     /* 125 registers, 2000 bits */
+
+typedef struct gateway_client {
+    gateway_t *gateway;
+    struct bufferevent *bev;
+} gateway_client_t;
+
+typedef struct gateway_waiter {
+    gateway_client_t *client;
+    uint16_t tid;
+    struct gateway_waiter *next;
+} gateway_waiter_t;
+
+typedef struct gateway_request {
+    uint8_t unit;
+    uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+    unsigned int pdu_len;
+    gateway_waiter_t *waiters;
+    struct gateway_request *next;
+} gateway_request_t;
+
+typedef struct gateway_cache_entry {
+    int64_t timestamp;          /* Monotonic, ms; zero if unused */
+    uint8_t unit;
+    uint8_t function;
+    uint16_t address;
+    uint16_t count;
+    uint8_t data[GATEWAY_CACHE_DATA];
+} gateway_cache_entry_t;
+
+struct gateway {
+    exporter_t *exporter;
+    struct evconnlistener *listener;
+    struct event *bus_ev;
+    gateway_request_t *queue_head;
+    gateway_request_t *queue_tail;
+    gateway_cache_entry_t cache[GATEWAY_CACHE_SIZE];
+};
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int is_read_function(int function)
+{
+    return function >= MODBUS_FC_READ_COILS && function <= MODBUS_FC_READ_INPUT_REGISTERS;
+}
+
+static int is_bit_function(int function)
+{
+    return function == MODBUS_FC_READ_COILS || function == MODBUS_FC_READ_DISCRETE_INPUTS;
+}
+
+static int read_data_length(int function, int count)
+{
+    return is_bit_function(function) ? (count + 7) / 8 : count * 2;
+}
+
+void gateway_cache_store(gateway_t *gateway, int unit, int function, int address, int count,
+                         const uint8_t *data)
+{
+    gateway_cache_entry_t *entry = &gateway->cache[0];
+    int data_len = read_data_length(function, count);
+
+    if (data_len > GATEWAY_CACHE_DATA)
+        return;
+
+    /* Replace the same block, or the oldest one */
+    for (int i = 0; i < GATEWAY_CACHE_SIZE; i++) {
+        gateway_cache_entry_t *e = &gateway->cache[i];
+        if (e->unit == unit && e->function == function && e->address == address && e->count == count) {
+            entry = e;
+            break;
+        }
+        if (e->timestamp < entry->timestamp)
+            entry = e;
+    }
+
+    entry->timestamp = monotonic_ms();
+    entry->unit = unit;
+    entry->function = function;
+    entry->address = address;
+    entry->count = count;
+    memcpy(entry->data, data, data_len);
+}
+
+static void cache_invalidate(gateway_t *gateway, int unit)
+{
+    for (int i = 0; i < GATEWAY_CACHE_SIZE; i++) {
+        if (gateway->cache[i].unit == unit)
+            gateway->cache[i].timestamp = 0;
+    }
+}
+
+/* Builds a read response PDU from a fresh cached block covering the request */
+static int cache_lookup(gateway_t *gateway, int unit, int function, int address, int count,
+                        uint8_t *rsp)
+{
+    int64_t min_timestamp = monotonic_ms() - gateway->exporter->options.gateway_max_age;
+
+    for (int i = 0; i < GATEWAY_CACHE_SIZE; i++) {
+        gateway_cache_entry_t *e = &gateway->cache[i];
+        if (!e->timestamp || e->timestamp < min_timestamp ||
+            e->unit != unit || e->function != function ||
+            address < e->address || address + count > e->address + e->count)
+            continue;
+
+        int data_len = read_data_length(function, count);
+        int offset = address - e->address;
+
+        rsp[0] = function;
+        rsp[1] = data_len;
+        if (is_bit_function(function)) {
+            memset(rsp + 2, 0, data_len);
+            for (int bit = 0; bit < count; bit++) {
+                int src = offset + bit;
+                if (e->data[src / 8] & (1 << (src % 8)))
+                    rsp[2 + bit / 8] |= 1 << (bit % 8);
+            }
+        } else {
+            memcpy(rsp + 2, e->data + offset * 2, data_len);
+        }
+
+        return 2 + data_len;
+    }
+
+    return -1;
+}
+
+static void send_response(gateway_client_t *client, uint16_t tid, uint8_t unit,
+                          const uint8_t *pdu, unsigned int pdu_len)
+{
+    uint8_t header[MBAP_HEADER_LENGTH] = {
+        tid >> 8, tid & 0xff, 0, 0, (pdu_len + 1) >> 8, (pdu_len + 1) & 0xff, unit
+    };
+    struct evbuffer *output = bufferevent_get_output(client->bev);
+
+    evbuffer_add(output, header, sizeof(header));
+    evbuffer_add(output, pdu, pdu_len);
+}
+
+/* Executes a request on the bus, returns the response PDU length */
+static int execute_request(gateway_t *gateway, gateway_request_t *req, uint8_t *rsp_pdu)
+{
+    exporter_t *exporter = gateway->exporter;
+    uint8_t raw[MODBUS_MAX_PDU_LENGTH + 1];
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+
+    if (exporter->options.dry_run)
+        return -1;
+
+    raw[0] = req->unit;
+    memcpy(raw + 1, req->pdu, req->pdu_len);
+
+    modbus_set_slave(exporter->modbus, req->unit);
+    if (req->unit == 0) {
+        /* Broadcast, no response. Not recorded, nor sent when replaying */
+        if (!exporter->options.replay_file &&
+            modbus_send_raw_request(exporter->modbus, raw, req->pdu_len + 1) < 0)
+            return -1;
+        return 0;
+    }
+
+    int len = collect_transact(exporter, raw, req->pdu_len + 1, rsp);
+    int offset = modbus_get_header_length(exporter->modbus);
+    if (len < offset + RTU_CHECKSUM_LENGTH + 2)
+        return -1;
+
+    int pdu_len = len - offset - RTU_CHECKSUM_LENGTH;
+    memcpy(rsp_pdu, rsp + offset, pdu_len);
+
+    int function = req->pdu[0];
+    int count = req->pdu[3] << 8 | req->pdu[4];
+    if (is_read_function(function) && rsp_pdu[0] == function &&
+        rsp_pdu[1] == read_data_length(function, count) && pdu_len >= 2 + rsp_pdu[1])
+        gateway_cache_store(gateway, req->unit, function, req->pdu[1] << 8 | req->pdu[2], count,
+                            rsp_pdu + 2);
+
+    return pdu_len;
+}
+
+static void bus_cb(evutil_socket_t fd, short what, void *arg)
+{
+    gateway_t *gateway = (gateway_t *) arg;
+    gateway_request_t *req = gateway->queue_head;
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+
+    if (!req)
+        return;
+    if (!(gateway->queue_head = req->next))
+        gateway->queue_tail = NULL;
+
+    int rsp_len = execute_request(gateway, req, rsp);
+    if (rsp_len < 0) {
+        rsp[0] = req->pdu[0] | 0x80;
+        rsp[1] = MODBUS_EXCEPTION_GATEWAY_TARGET;
+        rsp_len = 2;
+    }
+
+    while (req->waiters) {
+        gateway_waiter_t *waiter = req->waiters;
+        req->waiters = waiter->next;
+
+        if (rsp_len > 0)
+            send_response(waiter->client, waiter->tid, req->unit, rsp, rsp_len);
+        free(waiter);
+    }
+    free(req);
+
+    /* One request per loop iteration, so collections get their turn */
+    if (gateway->queue_head)
+        event_active(gateway->bus_ev, EV_TIMEOUT, 0);
+}
+
+static int add_waiter(gateway_request_t *req, gateway_client_t *client, uint16_t tid)
+{
+    gateway_waiter_t *waiter = calloc(1, sizeof(gateway_waiter_t));
+    if (!waiter)
+        return -1;
+
+    waiter->client = client;
+    waiter->tid = tid;
+
+    gateway_waiter_t **tail = &req->waiters;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = waiter;
+    return 0;
+}
+
+static void handle_request(gateway_client_t *client, uint16_t tid, uint8_t unit,
+                           const uint8_t *pdu, unsigned int pdu_len)
+{
+    gateway_t *gateway = client->gateway;
+    int function = pdu[0];
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+
+    if (is_read_function(function) && pdu_len == 5) {
+        int address = pdu[1] << 8 | pdu[2];
+        int count = pdu[3] << 8 | pdu[4];
+        int max = is_bit_function(function) ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+
+        if (count < 1 || count > max) {
+            rsp[0] = function | 0x80;
+            rsp[1] = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            send_response(client, tid, unit, rsp, 2);
+            return;
+        }
+
+        int rsp_len = cache_lookup(gateway, unit, function, address, count, rsp);
+        if (rsp_len > 0) {
+            send_response(client, tid, unit, rsp, rsp_len);
+            return;
+        }
+
+        for (gateway_request_t *req = gateway->queue_head; req; req = req->next) {
+            if (req->unit == unit && req->pdu_len == pdu_len && !memcmp(req->pdu, pdu, pdu_len)) {
+                add_waiter(req, client, tid);
+                return;
+            }
+        }
+    } else {
+        /* Anything else may modify the device */
+        cache_invalidate(gateway, unit);
+    }
+
+    gateway_request_t *req = calloc(1, sizeof(gateway_request_t));
+    if (!req || add_waiter(req, client, tid) < 0) {
+        free(req);
+        return;
+    }
+
+    req->unit = unit;
+    req->pdu_len = pdu_len;
+    memcpy(req->pdu, pdu, pdu_len);
+
+    if (gateway->queue_tail)
+        gateway->queue_tail->next = req;
+    else
+        gateway->queue_head = req;
+    gateway->queue_tail = req;
+
+    event_active(gateway->bus_ev, EV_TIMEOUT, 0);
+}
+
+static void client_free(gateway_client_t *client)
+{
+    gateway_t *gateway = client->gateway;
+
+    /* Drop pending responses to this client */
+    for (gateway_request_t *req = gateway->queue_head; req; req = req->next) {
+        gateway_waiter_t **w = &req->waiters;
+        while (*w) {
+            if ((*w)->client == client) {
+                gateway_waiter_t *waiter = *w;
+                *w = waiter->next;
+                free(waiter);
+            } else {
+                w = &(*w)->next;
+            }
+        }
+    }
+
+    bufferevent_free(client->bev);
+    free(client);
+}
+
+static void client_read_cb(struct bufferevent *bev, void *arg)
+{
+    gateway_client_t *client = (gateway_client_t *) arg;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    uint8_t frame[MBAP_HEADER_LENGTH + MODBUS_MAX_PDU_LENGTH];
+
+    while (evbuffer_get_length(input) >= MBAP_HEADER_LENGTH) {
+        evbuffer_copyout(input, frame, MBAP_HEADER_LENGTH);
+
+        uint16_t tid = frame[0] << 8 | frame[1];
+        uint16_t protocol = frame[2] << 8 | frame[3];
+        uint16_t length = frame[4] << 8 | frame[5];
+        if (protocol != 0 || length < 2 || length > MODBUS_MAX_PDU_LENGTH + 1) {
+            client_free(client);
+            return;
+        }
+        if (evbuffer_get_length(input) < MBAP_HEADER_LENGTH - 1 + length)
+            return;
+
+        evbuffer_remove(input, frame, MBAP_HEADER_LENGTH - 1 + length);
+        handle_request(client, tid, frame[6], frame + MBAP_HEADER_LENGTH, length - 1);
+    }
+}
+
+static void client_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        client_free((gateway_client_t *) arg);
+}
+
+static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                      struct sockaddr *addr, int socklen, void *arg)
+{
+    gateway_t *gateway = (gateway_t *) arg;
+    gateway_client_t *client = calloc(1, sizeof(gateway_client_t));
+
+    if (!client) {
+        evutil_closesocket(fd);
+        return;
+    }
+
+    client->gateway = gateway;
+    client->bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd,
+                                         BEV_OPT_CLOSE_ON_FREE);
+    if (!client->bev) {
+        evutil_closesocket(fd);
+        free(client);
+        return;
+    }
+
+    bufferevent_setcb(client->bev, client_read_cb, NULL, client_event_cb, client);
+    bufferevent_enable(client->bev, EV_READ | EV_WRITE);
+}
+
+gateway_t *gateway_start(exporter_t *exporter, struct event_base *base)
+{
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(exporter->options.gateway_port)
+    };
+    gateway_t *gateway = calloc(1, sizeof(gateway_t));
+    if (!gateway) {
+        fprintf(stderr, "Failed to allocate gateway.\n");
+        return NULL;
+    }
+
+    if (inet_pton(AF_INET, exporter->options.bind_addr, &sin.sin_addr) != 1) {
+        fprintf(stderr, "Invalid bind address %s.\n", exporter->options.bind_addr);
+        goto error;
+    }
+
+    gateway->exporter = exporter;
+    gateway->bus_ev = event_new(base, -1, 0, bus_cb, gateway);
+    gateway->listener = evconnlistener_new_bind(base, accept_cb, gateway,
+            LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
+            (struct sockaddr *) &sin, sizeof(sin));
+    if (!gateway->bus_ev || !gateway->listener) {
+        fprintf(stderr, "Failed to start Modbus TCP gateway on port %d.\n",
+                exporter->options.gateway_port);
+        goto error;
+    }
+
+    return gateway;
+
+error:
+    if (gateway->listener)
+        evconnlistener_free(gateway->listener);
+    if (gateway->bus_ev)
+        event_free(gateway->bus_ev);
+    free(gateway);
+    return NULL;
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <event2/buffer.h>
+#include "exporter485.h"
+
+#define HISTORY_MAGIC       0x48353834  /* "485H" */
+#define HISTORY_VERSION     1
+#define HISTORY_NAME_LEN    64
+#define SERIES_NONE         UINT32_MAX
+
+/* On-disk layout: the header, a directory of max_series entries and then a
+ * ring of `samples` entries for every directory entry. The file is sized
+ * once on creation, so recording a sample never allocates.
+ */
+typedef struct history_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t samples;
+    uint32_t max_series;
+    uint32_t series_count;
+    uint32_t reserved;
+} history_header_t;
+
+typedef struct history_series {
+    char module[HISTORY_NAME_LEN];
+    char metric[HISTORY_NAME_LEN];
+    uint32_t target;
+    uint32_t reserved;
+    uint64_t written;           /* Total samples, next slot is written % samples */
+} history_series_t;
+
+typedef struct history_sample {
+    int64_t timestamp;          /* ms since the epoch */
+    double value;
+} history_sample_t;
+
+/* In-memory index from a (metric, target) pair to its series, so names only
+ * need to be compared the first time a series is seen.
+ */
+typedef struct history_slot {
+    const metric_t *metric;
+    uint32_t target;
+    uint32_t series;
+} history_slot_t;
+
+struct history {
+    int fd;
+    size_t size;
+    history_header_t *header;
+    history_series_t *series;
+    history_sample_t *rings;
+    history_slot_t *slots;
+    unsigned int slots_size;
+    unsigned int slots_used;
+    int full_warned;
+    pthread_mutex_t lock;       /* Recording and rendering may run on different threads */
+};
+
+static size_t history_file_size(unsigned int samples, unsigned int series)
+{
+    return sizeof(history_header_t) +
+           (size_t) series * sizeof(history_series_t) +
+           (size_t) series * samples * sizeof(history_sample_t);
+}
+
+history_t *history_open(const char *filename, unsigned int samples, unsigned int series)
+{
+    struct stat st;
+    history_t *history = calloc(1, sizeof(history_t));
+    if (!history) {
+        fprintf(stderr, "Failed to allocate history.\n");
+        return NULL;
+    }
+
+    history->fd = -1;
+    pthread_mutex_init(&history->lock, NULL);
+    history->size = history_file_size(samples, series);
+    history->slots_size = 4;
+    while (history->slots_size < series * 2)
+        history->slots_size <<= 1;
+    history->slots = calloc(history->slots_size, sizeof(history_slot_t));
+    if (!history->slots) {
+        fprintf(stderr, "Failed to allocate history.\n");
+        goto error;
+    }
+
+    if ((history->fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0 ||
+        fstat(history->fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        goto error;
+    }
+
+    int created = (st.st_size == 0);
+    if (created) {
+        if (ftruncate(history->fd, history->size) < 0) {
+            fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+            goto error;
+        }
+    } else if (st.st_size != history->size) {
+        fprintf(stderr, "%s: history file was created with different sample/series limits\n",
+                filename);
+        goto error;
+    }
+
+    void *map = mmap(NULL, history->size, PROT_READ | PROT_WRITE, MAP_SHARED, history->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap: %s\n", filename, strerror(errno));
+        goto error;
+    }
+
+    history->header = map;
+    history->series = (history_series_t *) (history->header + 1);
+    history->rings = (history_sample_t *) (history->series + series);
+
+    if (created) {
+        history->header->magic = HISTORY_MAGIC;
+        history->header->version = HISTORY_VERSION;
+        history->header->samples = samples;
+        history->header->max_series = series;
+    } else if (history->header->magic != HISTORY_MAGIC ||
+               history->header->version != HISTORY_VERSION ||
+               history->header->samples != samples ||
+               history->header->max_series != series ||
+               history->header->series_count > series) {
+        fprintf(stderr, "%s: invalid or incompatible history file\n", filename);
+        goto error;
+    }
+
+    return history;
+
+error:
+    history_close(history);
+    return NULL;
+}
+
+void history_close(history_t *history)
+{
+    if (history->header)
+        munmap(history->header, history->size);
+    if (history->fd >= 0)
+        close(history->fd);
+    free(history->slots);
+    pthread_mutex_destroy(&history->lock);
+    free(history);
+}
+
+static uint32_t history_slot_hash(const metric_t *metric, int target)
+{
+    uintptr_t h = (uintptr_t) metric / sizeof(metric_t);
+
+    h ^= (uintptr_t) target * 0x9e3779b1u;
+    return (uint32_t) (h ^ (h >> 16));
+}
+
+/* Returns the series index of a (metric, target) pair, or SERIES_NONE. If
+ * create is set, a new series is added to the directory when needed.
+ */
+static uint32_t history_find_series(history_t *history, module_t *module,
+                                    const metric_t *metric, int target, int create)
+{
+    unsigned int mask = history->slots_size - 1;
+    unsigned int i = history_slot_hash(metric, target) & mask;
+    unsigned int probes = 0;
+
+    while (history->slots[i].metric) {
+        if (history->slots[i].metric == metric && history->slots[i].target == target)
+            return history->slots[i].series;
+        if (++probes == history->slots_size)
+            return SERIES_NONE;
+        i = (i + 1) & mask;
+    }
+
+    history_header_t *header = history->header;
+    uint32_t series = SERIES_NONE;
+
+    for (uint32_t s = 0; s < header->series_count; s++) {
+        history_series_t *hs = &history->series[s];
+        if (hs->target == target &&
+            !strncmp(hs->module, module->name, HISTORY_NAME_LEN) &&
+            !strncmp(hs->metric, metric->name, HISTORY_NAME_LEN)) {
+            series = s;
+            break;
+        }
+    }
+
+    if (series == SERIES_NONE) {
+        if (!create)
+            return SERIES_NONE;
+
+        if (strlen(module->name) >= HISTORY_NAME_LEN || strlen(metric->name) >= HISTORY_NAME_LEN) {
+            if (history->slots_used < history->slots_size / 4)
+                fprintf(stderr, "history: %s_%s: name too long, not recorded\n",
+                        module->name, metric->name);
+        } else if (header->series_count == header->max_series) {
+            if (!history->full_warned) {
+                fprintf(stderr, "history: all %u series in use, not recording new series\n",
+                        header->max_series);
+                history->full_warned = 1;
+            }
+        } else {
+            series = header->series_count;
+            history_series_t *hs = &history->series[series];
+            strcpy(hs->module, module->name);
+            strcpy(hs->metric, metric->name);
+            hs->target = target;
+            hs->written = 0;
+            header->series_count++;
+        }
+    }
+
+    /* Failures are cached too, so they are only reported once, but only while
+     * the table is a quarter full. Series take at most half of the slots, so
+     * a quarter is always free to end probes.
+     */
+    if (series == SERIES_NONE && history->slots_used >= history->slots_size / 4)
+        return series;
+
+    history->slots[i].metric = metric;
+    history->slots[i].target = target;
+    history->slots[i].series = series;
+    history->slots_used++;
+
+    return series;
+}
+
+void history_record(history_t *history, module_t *module, int target, metrics_value_set_t *values)
+{
+    uint32_t samples = history->header->samples;
+
+    pthread_mutex_lock(&history->lock);
+    for (int i = 0; i < values->values_count; i++) {
+        metric_t *metric = &module->metrics[i];
+        if (!values->valid[i])
+            continue;
+
+        uint32_t series = history_find_series(history, module, metric, target, 1);
+        if (series == SERIES_NONE)
+            continue;
+
+        history_series_t *hs = &history->series[series];
+        history_sample_t *sample = &history->rings[(size_t) series * samples + hs->written % samples];
+
+        sample->timestamp = values->timestamp;
+        sample->value = metric_value_get_double(metric, &values->values[i]);
+        hs->written++;
+    }
+    pthread_mutex_unlock(&history->lock);
+}
+
+static void render_series(history_t *history, module_t *module, metric_t *metric,
+                          int target, uint32_t series, int delta, struct evbuffer *buf)
+{
+    uint32_t samples = history->header->samples;
+    history_series_t *hs = &history->series[series];
+    history_sample_t *ring = &history->rings[(size_t) series * samples];
+    uint64_t written = hs->written;
+    uint64_t count = written < samples ? written : samples;
+    int64_t last_ts = 0;
+
+    if (delta) {
+        evbuffer_add_printf(buf, "@%s_%s %d %llu\n", module->name, metric->name,
+                            target, (unsigned long long) count);
+    } else {
+        if (metric->help)
+            evbuffer_add_printf(buf, "# HELP %s_%s %s\n", module->name, metric->name, metric->help);
+        evbuffer_add_printf(buf, "# TYPE %s_%s %s\n", module->name, metric->name,
+                            metric->metric_type == METRIC_TYPE_GAUGE ? "gauge" : "unknown");
+    }
+
+    for (uint64_t n = written - count; n < written; n++) {
+        history_sample_t *sample = &ring[n % samples];
+
+        if (delta) {
+            evbuffer_add_printf(buf, "%lld %.10g\n",
+                                (long long) (n == written - count ? sample->timestamp :
+                                             sample->timestamp - last_ts),
+                                sample->value);
+            last_ts = sample->timestamp;
+        } else {
+            evbuffer_add_printf(buf, "%s_%s{instance=\"%d\"} %.10g %lld.%03lld\n",
+                                module->name, metric->name, target, sample->value,
+                                (long long) (sample->timestamp / 1000),
+                                (long long) (sample->timestamp % 1000));
+        }
+    }
+}
+
+int history_render(history_t *history, module_t *module, int target, const char *metric_name,
+                   int delta, struct evbuffer *buf)
+{
+    int rendered = 0;
+
+    pthread_mutex_lock(&history->lock);
+    for (int i = 0; i < module->metrics_count; i++) {
+        metric_t *metric = &module->metrics[i];
+        if (metric_name && strcmp(metric->name, metric_name) != 0)
+            continue;
+
+        uint32_t series = history_find_series(history, module, metric, target, 0);
+        if (series == SERIES_NONE)
+            continue;
+
+        render_series(history, module, metric, target, series, delta, buf);
+        rendered++;
+    }
+    pthread_mutex_unlock(&history->lock);
+
+    if (!delta)
+        evbuffer_add_printf(buf, "# EOF\n");
+
+    return rendered;
+}
@@ -27,97 +27,452 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <event2/http.h>
 #include <event2/buffer.h>
 #include <event2/keyvalq_struct.h>
+#include <event2/listener.h>
 #include "exporter485.h"
 
-static struct evbuffer *render_metrics(module_t *module, metrics_value_set_t *vals)
+/* Labels and the timestamp of a sample are optional */
+static void render_sample_end(struct evbuffer *buf, int64_t timestamp)
 {
-    struct evbuffer *buf = evbuffer_new();
+    if (timestamp)
+        evbuffer_add_printf(buf, " %lld", (long long) timestamp);
+    evbuffer_add(buf, "\n", 1);
+}
 
-    for (int i = 0; i < module->metrics_count; i++) {
-        metric_t *metric = module->metrics[i];
-
-        if (metric->help)
-            evbuffer_add_printf(
-                    buf,
-                    "# HELP %s_%s %s\n",
-                    module->name,
-                    metric->name,
-                    metric->help);
+/* Bitfield metrics are exported as one boolean series per named bit */
+static void render_bitfield(struct evbuffer *buf, const bitfield_t *bitfield, module_t *module,
+                            metric_value_t *value, const char *labels, int64_t timestamp)
+{
+    uint32_t raw = value->uint_value;
+    uint8_t packed[4] = { raw, raw >> 8, raw >> 16, raw >> 24 };
+    uint8_t bits[32];
+
+    unpack_bits(packed, bitfield->count, bits);
+    for (int i = 0; i < bitfield->count; i++) {
+        if (!bitfield->names[i])
+            continue;
+        evbuffer_add_printf(buf, "%s_%s{%s%sflag=\"%s\"} %u", module->name,
+                            bitfield->metric->name, labels ? labels : "", labels ? "," : "",
+                            bitfield->names[i], bits[i]);
+        render_sample_end(buf, timestamp);
+    }
+}
+
+static void render_value(struct evbuffer *buf, exporter_t *exporter, module_t *module,
+                         metric_t *metric, metric_value_t *value, const char *labels,
+                         int64_t timestamp)
+{
+    if (metric->bitfield) {
+        render_bitfield(buf, modules_get_bitfield(exporter->modules, metric), module, value,
+                        labels, timestamp);
+        return;
+    }
+
+    evbuffer_add_printf(buf, "%s_%s%s%s%s", module->name, metric->name,
+                        labels ? "{" : "", labels ? labels : "", labels ? "}" : "");
+    switch (metric->data_type) {
+        case DATA_TYPE_FLOAT16:
+        case DATA_TYPE_FLOAT32:
+            evbuffer_add_printf(buf, " %f", value->float_value);
+            break;
+        case DATA_TYPE_INT16:
+        case DATA_TYPE_INT32:
+            evbuffer_add_printf(buf, " %d", value->int_value);
+            break;
+        case DATA_TYPE_UINT16:
+        case DATA_TYPE_UINT32:
+            evbuffer_add_printf(buf, " %u", value->uint_value);
+            break;
+    }
+    render_sample_end(buf, timestamp);
+}
+
+static void render_metric_header(struct evbuffer *buf, module_t *module, metric_t *metric)
+{
+    if (metric->help)
         evbuffer_add_printf(
                 buf,
-                "# TYPE %s_%s %s\n",
+                "# HELP %s_%s %s\n",
                 module->name,
                 metric->name,
-                get_metric_type_str(metric->metric_type));
-
-        switch (metric->data_type) {
-            case DATA_TYPE_FLOAT16:
-            case DATA_TYPE_FLOAT32:
-                evbuffer_add_printf(buf, "%s_%s %f\n", module->name,
-                        metric->name, vals->values[i].float_value);
-                break;
-            case DATA_TYPE_INT16:
-            case DATA_TYPE_INT32:
-                evbuffer_add_printf( buf, "%s_%s %d\n", module->name,
-                        metric->name, vals->values[i].int_value);
-                break;
-            case DATA_TYPE_UINT16:
-            case DATA_TYPE_UINT32:
-                evbuffer_add_printf( buf, "%s_%s %u\n", module->name,
-                                     metric->name, vals->values[i].uint_value);
-                break;
-        }
+                metric->help);
+    evbuffer_add_printf(
+            buf,
+            "# TYPE %s_%s %s\n",
+            module->name,
+            metric->name,
+            get_metric_type_str(metric->metric_type));
+}
+
+/* Outcome of the collection, and cumulative read errors of the target */
+static void render_collect_status(struct evbuffer *buf, exporter_t *exporter, module_t *module,
+                                  int target, metrics_value_set_t *vals, const char *labels)
+{
+    const char *open = labels ? "{" : "", *close = labels ? "}" : "";
+
+    if (!labels)
+        labels = "";
+    evbuffer_add_printf(buf,
+            "# HELP exporter485_collect_success Whether all reads succeeded\n"
+            "# TYPE exporter485_collect_success gauge\n"
+            "exporter485_collect_success%s%s%s %d\n"
+            "# HELP exporter485_collect_errors Number of failed reads\n"
+            "# TYPE exporter485_collect_errors gauge\n"
+            "exporter485_collect_errors%s%s%s %u\n",
+            open, labels, close, vals->errors == 0, open, labels, close, vals->errors);
+
+    unsigned int count;
+    block_errors_t *blocks = collect_get_block_errors(exporter, module, target, &count);
+    if (!blocks)
+        return;
+
+    evbuffer_add_printf(buf,
+            "# HELP exporter485_block_errors_total Failed reads by block\n"
+            "# TYPE exporter485_block_errors_total counter\n");
+    for (int i = 0; i < count; i++) {
+        block_errors_t *be = &blocks[i];
+        evbuffer_add_printf(buf,
+                "exporter485_block_errors_total{%s%sinput_type=\"%s\",address=\"0x%04x\"} %llu\n",
+                labels, *labels ? "," : "", get_input_type_str(be->input_type), be->address,
+                (unsigned long long) be->count);
+    }
+    free(blocks);
+}
+
+/* Labels, if any, are added to every series */
+struct evbuffer *render_metrics(exporter_t *exporter, module_t *module, int target,
+                                const metric_group_t *group, metrics_value_set_t *vals,
+                                const char *labels)
+{
+    struct evbuffer *buf = evbuffer_new();
+
+    for (int i = 0; i < module->metrics_count; i++) {
+        metric_t *metric = &module->metrics[i];
+
+        if (!vals->valid[i] || (group && group->select[i] != SELECT_EXPORTED))
+            continue;
+
+        render_metric_header(buf, module, metric);
+        render_value(buf, exporter, module, metric, &vals->values[i], labels, 0);
     }
 
+    render_collect_status(buf, exporter, module, target, vals, labels);
     return buf;
 }
 
+/* Series of the same metric are rendered together, under a single HELP/TYPE,
+ * with the target as a label and the time each target was collected.
+ */
+static void render_fleet(struct evbuffer *buf, exporter_t *exporter, const fleet_set_t *set)
+{
+    modules_t *modules = exporter->modules;
+    char labels[64];
+
+    evbuffer_add_printf(buf,
+            "# HELP exporter485_fleet_generation Sequence number of the fleet snapshot\n"
+            "# TYPE exporter485_fleet_generation gauge\n"
+            "exporter485_fleet_generation %llu %lld\n"
+            "# HELP exporter485_fleet_window_seconds Time taken to collect the fleet snapshot\n"
+            "# TYPE exporter485_fleet_window_seconds gauge\n"
+            "exporter485_fleet_window_seconds %.3f %lld\n",
+            (unsigned long long) set->generation, (long long) set->start,
+            (set->end - set->start) / 1000.0, (long long) set->start);
+
+    for (int m = 0; m < modules->modules_count; m++) {
+        module_t *module = &modules->modules[m];
+
+        for (int i = 0; i < module->metrics_count; i++) {
+            metric_t *metric = &module->metrics[i];
+            int rendered = 0;
+
+            for (int j = 0; j < modules->fleet_count; j++) {
+                metrics_value_set_t *values = set->values[j];
+                if (modules->fleet[j].module != module || !values || !values->valid[i])
+                    continue;
+
+                if (!rendered++)
+                    render_metric_header(buf, module, metric);
+                snprintf(labels, sizeof(labels), "target=\"%u\"", modules->fleet[j].target);
+                render_value(buf, exporter, module, metric, &values->values[i], labels,
+                             values->timestamp);
+            }
+        }
+    }
+
+    evbuffer_add_printf(buf,
+            "# HELP exporter485_collect_errors Number of failed reads\n"
+            "# TYPE exporter485_collect_errors gauge\n");
+    for (int j = 0; j < modules->fleet_count; j++) {
+        metrics_value_set_t *values = set->values[j];
+        if (values)
+            evbuffer_add_printf(buf, "exporter485_collect_errors{module=\"%s\",target=\"%u\"} %u %lld\n",
+                                modules->fleet[j].module->name, modules->fleet[j].target,
+                                values->errors, (long long) values->timestamp);
+    }
+}
+
+static void reply_metrics(struct evhttp_request *req, exporter_t *exporter, module_t *module,
+                          int target, const metric_group_t *group, metrics_value_set_t *values)
+{
+    if (!values) {
+        evhttp_send_error(req, HTTP_INTERNAL, "Failed to collect metrics");
+        return;
+    }
+
+    struct evbuffer *buf = render_metrics(exporter, module, target, group, values, NULL);
+
+    evhttp_add_header (evhttp_request_get_output_headers (req),
+                       "Content-Type", "text/plain");
+    evhttp_send_reply(req, HTTP_OK, NULL, buf);
+    evbuffer_free(buf);
+}
+
+static void metrics_collected(collect_job_t *job)
+{
+    reply_metrics(job->req, job->exporter, job->module, job->target, job->group, job->values);
+}
+
+/* Metrics are selected with collect[]=NAME or metric=NAME (repeated as needed),
+ * where NAME is a metric or a group of the module. A single group uses its
+ * prebuilt plan, other selections get an ad-hoc group. No selection means
+ * all metrics, and a NULL group.
+ */
+static int is_selection_param(const char *key)
+{
+    return !strcmp(key, "metric") || !strcmp(key, "collect[]") || !strcasecmp(key, "collect%5b%5d");
+}
+
+static int parse_selection(modules_t *modules, module_t *module, struct evkeyvalq *params,
+                           metric_group_t **group)
+{
+    struct evkeyval *param;
+    metric_group_t *adhoc = NULL;
+
+    *group = NULL;
+    for (param = params->tqh_first; param; param = param->next.tqe_next) {
+        if (!is_selection_param(param->key))
+            continue;
+
+        if (!*group && (*group = modules_get_group(module, param->value)))
+            continue;
+
+        if (!adhoc) {
+            if (!(adhoc = modules_group_new(module)))
+                goto error;
+            if (*group)
+                modules_group_add(module, adhoc, (*group)->name);
+            *group = adhoc;
+        }
+        if (modules_group_add(module, adhoc, param->value) < 0)
+            goto error;
+    }
+
+    if (adhoc && modules_group_build(modules, module, adhoc) < 0)
+        goto error;
+    return 0;
+
+error:
+    if (adhoc)
+        modules_group_free(adhoc);
+    *group = NULL;
+    return -1;
+}
+
 void handle_metrics(struct evhttp_request *req, void *arg) {
     exporter_t *exporter = (exporter_t *) arg;
     struct evkeyvalq params;
-    evhttp_parse_query(evhttp_request_get_uri(req), &params);
+
+    /* Parsed leniently, so collect[] is accepted without escaping */
+    const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+    evhttp_parse_query_str(query ? query : "", &params);
 
     const char *module_name;
     if (!(module_name = evhttp_find_header(&params, "module"))) {
         /* TODO: Exporter metrics here */
         evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
-        return;
+        goto done;
     }
 
     module_t *module = modules_get_module(exporter->modules, module_name);
     if (!module) {
         evhttp_send_error(req, HTTP_NOTFOUND, "Module not found");
-        return;
+        goto done;
     }
 
     const char *target_param = evhttp_find_header(&params, "target");
     if (!target_param) {
         evhttp_send_error(req, HTTP_BADREQUEST, "Missing target");
-        return;
+        goto done;
     }
 
     int target = atoi(target_param);
-    if (target < 1 || target > 247) {
+    if (target < 1 || target > MAX_TARGET) {
         evhttp_send_error(req, HTTP_BADREQUEST, "Invalid target id");
-        return;
+        goto done;
+    }
+
+    metric_group_t *group;
+    if (parse_selection(exporter->modules, module, &params, &group) < 0) {
+        evhttp_send_error(req, HTTP_BADREQUEST, "Unknown metric or group");
+        goto done;
+    }
+
+    /* Polled pairs are served from the latest poll, without touching the bus */
+    metrics_value_set_t *values = NULL;
+    if (exporter->snapshots)
+        values = snapshots_read(exporter->snapshots, module, target);
+
+    if (!values && exporter->workers) {
+        if (workers_collect(exporter, req, module, target, group, metrics_collected) < 0) {
+            evhttp_send_error(req, HTTP_INTERNAL, "Failed to collect metrics");
+            if (group)
+                modules_group_free(group);
+        }
+        goto done;
     }
 
-    metrics_value_set_t *values = metrics_value_set_collect(exporter, module, target);
     if (!values) {
-        evhttp_send_error(req, HTTP_INTERNAL, "Failed to collect metrics");
+        values = metrics_value_set_collect(exporter, module, target, group);
+        if (values)
+            collect_record(exporter, module, target, values);
+    }
+
+    reply_metrics(req, exporter, module, target, group, values);
+    if (values)
+        metrics_value_set_free(values);
+    if (group)
+        modules_group_free(group);
+
+done:
+    evhttp_clear_headers(&params);
+}
+
+void handle_history(struct evhttp_request *req, void *arg)
+{
+    exporter_t *exporter = (exporter_t *) arg;
+    struct evkeyvalq params;
+
+    if (!exporter->history) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "History not enabled");
         return;
     }
-    struct evbuffer *buf = render_metrics(module, values);
-    metrics_value_set_free(values);
 
-    evhttp_add_header (evhttp_request_get_output_headers (req),
-                       "Content-Type", "text/plain");
-    evhttp_send_reply(req, HTTP_OK, NULL, buf);
+    evhttp_parse_query(evhttp_request_get_uri(req), &params);
+
+    const char *module_name = evhttp_find_header(&params, "module");
+    module_t *module = module_name ? modules_get_module(exporter->modules, module_name) : NULL;
+    if (!module) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "Module not found");
+        goto done;
+    }
+
+    const char *target_param = evhttp_find_header(&params, "target");
+    int target = target_param ? atoi(target_param) : 0;
+    if (target < 1 || target > MAX_TARGET) {
+        evhttp_send_error(req, HTTP_BADREQUEST, "Invalid target id");
+        goto done;
+    }
+
+    /* format=openmetrics (default) can be fed to promtool for backfilling,
+     * format=delta is a compact form with delta encoded timestamps.
+     */
+    const char *format = evhttp_find_header(&params, "format");
+    int delta = 0;
+    if (format && !strcmp(format, "delta")) {
+        delta = 1;
+    } else if (format && strcmp(format, "openmetrics") != 0) {
+        evhttp_send_error(req, HTTP_BADREQUEST, "Invalid format");
+        goto done;
+    }
+
+    const char *metric_name = evhttp_find_header(&params, "metric");
+    struct evbuffer *buf = evbuffer_new();
+    if (!history_render(exporter->history, module, target, metric_name, delta, buf) && metric_name) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "Metric not found");
+    } else {
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                          delta ? "text/plain" :
+                          "application/openmetrics-text; version=1.0.0; charset=utf-8");
+        evhttp_send_reply(req, HTTP_OK, NULL, buf);
+    }
+    evbuffer_free(buf);
+
+done:
+    evhttp_clear_headers(&params);
+}
+
+/* Live values of a background polled module/target pair */
+void handle_stream(struct evhttp_request *req, void *arg)
+{
+    exporter_t *exporter = (exporter_t *) arg;
+    struct evkeyvalq params;
+
+    evhttp_parse_query(evhttp_request_get_uri(req), &params);
+
+    const char *module_name = evhttp_find_header(&params, "module");
+    module_t *module = module_name ? modules_get_module(exporter->modules, module_name) : NULL;
+    if (!module) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "Module not found");
+        goto done;
+    }
+
+    const char *target_param = evhttp_find_header(&params, "target");
+    int target = target_param ? atoi(target_param) : 0;
+    if (target < 1 || target > MAX_TARGET) {
+        evhttp_send_error(req, HTTP_BADREQUEST, "Invalid target id");
+        goto done;
+    }
+
+    poll_t *poll = NULL;
+    for (int i = 0; i < exporter->modules->polls_count && !poll; i++) {
+        if (exporter->modules->polls[i].module == module && exporter->modules->polls[i].target == target)
+            poll = &exporter->modules->polls[i];
+    }
+    if (!poll || !exporter->streams) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "Target is not polled");
+        goto done;
+    }
+
+    if (streams_subscribe(exporter->streams, req, poll) < 0)
+        evhttp_send_error(req, HTTP_INTERNAL, "Failed to subscribe");
+
+done:
+    evhttp_clear_headers(&params);
+}
+
+/* The latest fleet snapshot, as one consistent set */
+void handle_fleet(struct evhttp_request *req, void *arg)
+{
+    exporter_t *exporter = (exporter_t *) arg;
+
+    if (!exporter->fleet) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "Fleet not configured");
+        return;
+    }
+
+    struct evbuffer *buf = evbuffer_new();
+    const fleet_set_t *set = fleet_acquire(exporter->fleet);
+    if (set)
+        render_fleet(buf, exporter, set);
+    fleet_release(exporter->fleet);
+
+    if (!set) {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, "No fleet snapshot yet");
+    } else {
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain");
+        evhttp_send_reply(req, HTTP_OK, NULL, buf);
+    }
     evbuffer_free(buf);
 }
 
@@ -140,3 +495,40 @@ void handle_config(struct evhttp_request *req, void *arg)
     }
 }
 
+
+struct evhttp *http_new(exporter_t *exporter, struct event_base *base)
+{
+    struct evhttp *http = evhttp_new(base);
+    if (!http)
+        return NULL;
+
+    evhttp_set_cb(http, "/config", handle_config, exporter);
+    evhttp_set_cb(http, "/metrics", handle_metrics, exporter);
+    evhttp_set_cb(http, "/history", handle_history, exporter);
+    evhttp_set_cb(http, "/stream", handle_stream, exporter);
+    evhttp_set_cb(http, "/fleet", handle_fleet, exporter);
+    return http;
+}
+
+/* Also serves http on a Unix domain socket, replacing a stale one */
+int http_bind_unix(struct evhttp *http, struct event_base *base, const char *path)
+{
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    struct stat st;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    struct evconnlistener *listener = evconnlistener_new_bind(base, NULL, NULL,
+            LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr *) &sun, sizeof(sun));
+    if (!listener || !evhttp_bind_listener(http, listener)) {
+        fprintf(stderr, "Failed to bind to %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
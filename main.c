@@ -29,9 +29,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <getopt.h>
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/thread.h>
 #include <modbus/modbus.h>
 
 #include "exporter485.h"
@@ -42,7 +46,7 @@ void usage(void)
            "\n"
            "Options:\n"
            "  -c, --config-file=FILE    Configuration file (default: config.yaml)\n"
-           "  -p, --port=PORT           HTTP port to listen on (default: 9485)\n"
+           "  -p, --port=PORT           HTTP port to listen on, 0 for none (default: 9485)\n"
            "  -b, --bind-addr=ADDR      Address to listen on (default: 0.0.0.0)\n"
            "  -d, --device=DEV          RS-485 serial device (default: /dev/tty/XRUSB0)\n"
            "      --baud-rate           Serial device baud rate (default: 115200)\n"
@@ -50,6 +54,36 @@ void usage(void)
            "      --data-bits           Serial device data bits (default: 8)\n"
            "      --stop-bits           Serial device sop bits (default: 1)\n"
            "      --dry-run             Dry-run mode, produce fake metrics\n"
+           "      --history-file=FILE   Keep recent samples in a persistent history file\n"
+           "      --history-samples=N   Samples kept per series in history (default: 1024)\n"
+           "      --history-series=N    Maximum number of series in history (default: 1024)\n"
+           "      --error-budget=N      Failed reads before giving up on a collection, -1 for\n"
+           "                            no limit (default: 3)\n"
+           "      --gateway-port=PORT   Modbus TCP gateway port (default: disabled)\n"
+           "      --gateway-max-age=MS  Maximum age of recently read data used to answer\n"
+           "                            gateway reads (default: 1000)\n"
+           "      --http-threads=N      Serve HTTP on N worker threads, leaving the main\n"
+           "                            thread to bus I/O (default: 0, no workers)\n"
+           "      --probe               Probe targets for unsupported addresses and use\n"
+           "                            plans specialized for each target\n"
+           "      --probe-cache=FILE    Keep probe results in FILE (implies --probe)\n"
+           "      --capture=FILE        Record all bus exchanges, with their timing, to FILE\n"
+           "      --replay=FILE         Serve bus exchanges recorded with --capture from FILE\n"
+           "                            instead of using the device\n"
+           "      --replay-fast         Replay as fast as possible, rather than at the\n"
+           "                            recorded speed\n"
+           "      --mqtt-broker=HOST[:PORT]\n"
+           "                            Publish every collection to an MQTT broker\n"
+           "      --mqtt-topic=PREFIX   Topic prefix, followed by /module/target\n"
+           "                            (default: exporter485)\n"
+           "      --mqtt-client-id=ID   MQTT client identifier (default: exporter485)\n"
+           "      --mqtt-qos=N          Publish with QoS 0 or 1 (default: 0)\n"
+           "      --mqtt-retain         Publish retained messages\n"
+           "      --mqtt-queue=N        Messages queued while the broker is unreachable,\n"
+           "                            before dropping the oldest (default: 1000)\n"
+           "      --unix-socket=PATH    Also serve HTTP on a Unix domain socket\n"
+           "      --textfile-dir=DIR    Write metrics of polled pairs to DIR after every poll,\n"
+           "                            for the node_exporter textfile collector\n"
     );
 }
 
@@ -64,7 +98,27 @@ int main(int argc, char *argv[])
         o_parity,
         o_data_bits,
         o_stop_bits,
-        o_dry_run
+        o_dry_run,
+        o_history_file,
+        o_history_samples,
+        o_history_series,
+        o_error_budget,
+        o_gateway_port,
+        o_gateway_max_age,
+        o_http_threads,
+        o_probe,
+        o_probe_cache,
+        o_capture,
+        o_replay,
+        o_replay_fast,
+        o_mqtt_broker,
+        o_mqtt_topic,
+        o_mqtt_client_id,
+        o_mqtt_qos,
+        o_mqtt_retain,
+        o_mqtt_queue,
+        o_unix_socket,
+        o_textfile_dir
     };
     static struct option long_options[] = {
         {"config-file",     required_argument,  0, 'c' },
@@ -76,6 +130,26 @@ int main(int argc, char *argv[])
         {"data_bits",       required_argument,  0, o_data_bits },
         {"stop_bits",       required_argument,  0, o_stop_bits },
         {"dry-run",         0,                  0, o_dry_run },
+        {"history-file",    required_argument,  0, o_history_file },
+        {"history-samples", required_argument,  0, o_history_samples },
+        {"history-series",  required_argument,  0, o_history_series },
+        {"error-budget",    required_argument,  0, o_error_budget },
+        {"gateway-port",    required_argument,  0, o_gateway_port },
+        {"gateway-max-age", required_argument,  0, o_gateway_max_age },
+        {"http-threads",    required_argument,  0, o_http_threads },
+        {"probe",           0,                  0, o_probe },
+        {"probe-cache",     required_argument,  0, o_probe_cache },
+        {"capture",         required_argument,  0, o_capture },
+        {"replay",          required_argument,  0, o_replay },
+        {"replay-fast",     0,                  0, o_replay_fast },
+        {"mqtt-broker",     required_argument,  0, o_mqtt_broker },
+        {"mqtt-topic",      required_argument,  0, o_mqtt_topic },
+        {"mqtt-client-id",  required_argument,  0, o_mqtt_client_id },
+        {"mqtt-qos",        required_argument,  0, o_mqtt_qos },
+        {"mqtt-retain",     0,                  0, o_mqtt_retain },
+        {"mqtt-queue",      required_argument,  0, o_mqtt_queue },
+        {"unix-socket",     required_argument,  0, o_unix_socket },
+        {"textfile-dir",    required_argument,  0, o_textfile_dir },
         {"help",            0,                  0, 'h' },
         {0,                 0,                  0, 0 }
     };
@@ -89,7 +163,27 @@ int main(int argc, char *argv[])
         .parity = 'N',
         .data_bits = 8,
         .stop_bits = 1,
-        .dry_run = 0
+        .dry_run = 0,
+        .history_file = NULL,
+        .history_samples = 1024,
+        .history_series = 1024,
+        .error_budget = 3,
+        .gateway_port = 0,
+        .gateway_max_age = 1000,
+        .http_threads = 0,
+        .probe = 0,
+        .probe_cache = NULL,
+        .capture_file = NULL,
+        .replay_file = NULL,
+        .replay_fast = 0,
+        .mqtt_broker = NULL,
+        .mqtt_topic = "exporter485",
+        .mqtt_client_id = "exporter485",
+        .mqtt_qos = 0,
+        .mqtt_retain = 0,
+        .mqtt_queue = 1000,
+        .unix_socket = NULL,
+        .textfile_dir = NULL
     };
 
     while (1) {
@@ -111,8 +205,8 @@ int main(int argc, char *argv[])
                 break;
             case 'p':
                 o.port = atoi(optarg);
-                if (o.port <= 0 || o.port > 65535) {
-                    fprintf(stderr, "Error: port must be 1-65535\n");
+                if (o.port < 0 || o.port > 65535) {
+                    fprintf(stderr, "Error: port must be 0-65535\n");
                     exit(1);
                 }
                 break;
@@ -131,46 +225,213 @@ int main(int argc, char *argv[])
             case o_dry_run:
                 o.dry_run = 1;
                 break;
+            case o_history_file:
+                o.history_file = optarg;
+                break;
+            case o_history_samples:
+                o.history_samples = atoi(optarg);
+                if (o.history_samples < 1) {
+                    fprintf(stderr, "Error: history samples must be positive\n");
+                    exit(1);
+                }
+                break;
+            case o_history_series:
+                o.history_series = atoi(optarg);
+                if (o.history_series < 1) {
+                    fprintf(stderr, "Error: history series must be positive\n");
+                    exit(1);
+                }
+                break;
+            case o_error_budget:
+                o.error_budget = atoi(optarg);
+                break;
+            case o_gateway_port:
+                o.gateway_port = atoi(optarg);
+                if (o.gateway_port <= 0 || o.gateway_port > 65535) {
+                    fprintf(stderr, "Error: gateway port must be 1-65535\n");
+                    exit(1);
+                }
+                break;
+            case o_gateway_max_age:
+                o.gateway_max_age = atoi(optarg);
+                break;
+            case o_http_threads:
+                o.http_threads = atoi(optarg);
+                if (o.http_threads < 0) {
+                    fprintf(stderr, "Error: http threads must not be negative\n");
+                    exit(1);
+                }
+                break;
+            case o_probe:
+                o.probe = 1;
+                break;
+            case o_probe_cache:
+                o.probe = 1;
+                o.probe_cache = optarg;
+                break;
+            case o_capture:
+                o.capture_file = optarg;
+                break;
+            case o_replay:
+                o.replay_file = optarg;
+                break;
+            case o_replay_fast:
+                o.replay_fast = 1;
+                break;
+            case o_mqtt_broker:
+                o.mqtt_broker = optarg;
+                break;
+            case o_mqtt_topic:
+                o.mqtt_topic = optarg;
+                break;
+            case o_mqtt_client_id:
+                o.mqtt_client_id = optarg;
+                break;
+            case o_mqtt_qos:
+                o.mqtt_qos = atoi(optarg);
+                if (o.mqtt_qos < 0 || o.mqtt_qos > 1) {
+                    fprintf(stderr, "Error: mqtt qos must be 0 or 1\n");
+                    exit(1);
+                }
+                break;
+            case o_mqtt_retain:
+                o.mqtt_retain = 1;
+                break;
+            case o_mqtt_queue:
+                o.mqtt_queue = atoi(optarg);
+                if (o.mqtt_queue < 1) {
+                    fprintf(stderr, "Error: mqtt queue must be positive\n");
+                    exit(1);
+                }
+                break;
+            case o_unix_socket:
+                o.unix_socket = optarg;
+                break;
+            case o_textfile_dir:
+                o.textfile_dir = optarg;
+                break;
             default:
                 exit(-1);
         }
     }
 
+    if ((o.capture_file || o.replay_file) && o.dry_run) {
+        fprintf(stderr, "Error: --capture and --replay can not be used with --dry-run\n");
+        exit(1);
+    }
+    if (o.capture_file && o.replay_file) {
+        fprintf(stderr, "Error: --capture and --replay are mutually exclusive\n");
+        exit(1);
+    }
+
     static exporter_t exporter = { 0 };
     exporter.options = o;
     if (!(exporter.modules = modules_load(o.config_file))) {
         exit(1);
     }
+    printf("Loaded %u modules, %u metrics (%zu bytes, %zu bytes of strings)\n",
+           exporter.modules->modules_count, exporter.modules->metrics_count,
+           exporter.modules->mem_size, exporter.modules->strings_len);
 
+    if (o.history_file &&
+        !(exporter.history = history_open(o.history_file, o.history_samples, o.history_series))) {
+        exit(1);
+    }
+
+    /* When replaying, the context is still used to build requests */
     if (!o.dry_run) {
         exporter.modbus = modbus_new_rtu(o.device, o.baud_rate, o.parity, o.data_bits, o.stop_bits);
-        if (modbus_connect(exporter.modbus) == -1) {
+        if (!o.replay_file && modbus_connect(exporter.modbus) == -1) {
             fprintf(stderr, "Error: connection failed: %s: %s\n", o.device, modbus_strerror(errno));
             modbus_free(exporter.modbus);
             exit(1);
         }
     }
 
+    if ((o.capture_file || o.replay_file) &&
+        !(exporter.capture = capture_open(o.capture_file ? o.capture_file : o.replay_file,
+                                          o.replay_file != NULL, o.replay_fast))) {
+        exit(1);
+    }
+
+    if (o.textfile_dir && !exporter.modules->polls_count) {
+        fprintf(stderr, "Error: --textfile-dir requires polls\n");
+        exit(1);
+    }
+    if (o.textfile_dir && access(o.textfile_dir, W_OK) < 0) {
+        fprintf(stderr, "Error: %s: %s\n", o.textfile_dir, strerror(errno));
+        exit(1);
+    }
+
+    if (o.probe && !(exporter.probe = probe_open(&exporter, o.probe_cache))) {
+        fprintf(stderr, "Failed to allocate probe state.\n");
+        exit(1);
+    }
+
+    if (exporter.modules->polls_count &&
+        !(exporter.snapshots = snapshots_create(exporter.modules))) {
+        fprintf(stderr, "Failed to allocate snapshots.\n");
+        exit(1);
+    }
+    if (exporter.modules->polls_count && !(exporter.streams = streams_create(&exporter))) {
+        fprintf(stderr, "Failed to allocate streams.\n");
+        exit(1);
+    }
+
+    /* Must precede creation of any event base */
+    if (o.http_threads && evthread_use_pthreads() < 0) {
+        fprintf(stderr, "Failed to enable threads.\n");
+        exit(1);
+    }
+
     base = event_base_new();
     if (!base) {
         fprintf(stderr, "Failed to create event base.\n");
         exit(1);
     }
 
-    http = evhttp_new(base);
-    if (!http) {
-        fprintf(stderr, "Failed to create http server.\n");
+    if (!o.http_threads) {
+        http = http_new(&exporter, base);
+        if (!http) {
+            fprintf(stderr, "Failed to create http server.\n");
+            exit(1);
+        }
+
+        if (o.port && evhttp_bind_socket(http, o.bind_addr, o.port) < 0) {
+            fprintf(stderr, "Failed to bind to socket.\n");
+            exit(1);
+        }
+        if (o.unix_socket && http_bind_unix(http, base, o.unix_socket) < 0) {
+            exit(1);
+        }
+    }
+
+    if (o.mqtt_broker &&
+        !(exporter.mqtt = mqtt_open(base, o.mqtt_broker, o.mqtt_client_id, o.mqtt_qos,
+                                    o.mqtt_retain, o.mqtt_queue))) {
+        exit(1);
+    }
+
+    if (o.gateway_port && !(exporter.gateway = gateway_start(&exporter, base))) {
+        exit(1);
+    }
+
+    if (poll_start(&exporter, base) < 0) {
+        exit(1);
+    }
+
+    if (exporter.modules->fleet_count && !(exporter.fleet = fleet_start(&exporter, base))) {
         exit(1);
     }
 
-    evhttp_set_cb(http, "/config", handle_config, &exporter);
-    evhttp_set_cb(http, "/metrics", handle_metrics, &exporter);
-    if (evhttp_bind_socket(http, o.bind_addr, o.port) < 0) {
-        fprintf(stderr, "Failed to bind to socket.\n");
+    if (o.http_threads && workers_start(&exporter, base) < 0) {
         exit(1);
     }
 
-    printf("Running exporter485 on %s:%u\n", o.bind_addr, o.port);
+    if (o.port)
+        printf("Running exporter485 on %s:%u\n", o.bind_addr, o.port);
+    if (o.unix_socket)
+        printf("Running exporter485 on %s\n", o.unix_socket);
     event_base_dispatch(base);
     return 0;
 }
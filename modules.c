@@ -28,6 +28,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <cyaml/cyaml.h>
 #include "exporter485.h"
@@ -35,9 +36,30 @@
 static const cyaml_strval_t input_type_strings[] = {
     { "holdingRegister", INPUT_TYPE_HOLDING_REGISTER },
     { "inputRegister", INPUT_TYPE_INPUT_REGISTER },
-        { "payloadOffset", INPUT_TYPE_PAYLOAD_OFFSET }
+    { "payloadOffset", INPUT_TYPE_PAYLOAD_OFFSET },
+    { "derived", INPUT_TYPE_DERIVED },
+    { "coil", INPUT_TYPE_COIL },
+    { "discreteInput", INPUT_TYPE_DISCRETE_INPUT }
 };
 
+const char *get_input_type_str(input_type_t input_type)
+{
+    for (int i = 0; i < CYAML_ARRAY_LEN(input_type_strings); i++) {
+        if (input_type_strings[i].val == input_type)
+            return input_type_strings[i].str;
+    }
+    return "unknown";
+}
+
+int get_input_type(const char *str)
+{
+    for (int i = 0; i < CYAML_ARRAY_LEN(input_type_strings); i++) {
+        if (!strcmp(input_type_strings[i].str, str))
+            return input_type_strings[i].val;
+    }
+    return -1;
+}
+
 static const cyaml_strval_t metric_type_strings[] = {
     { "untyped", METRIC_TYPE_UNTYPED },
     { "counter", METRIC_TYPE_COUNTER },
@@ -72,117 +94,1089 @@ static const cyaml_strval_t word_order_strings[] = {
         { "little", WORD_ORDER_HIGH_LOW }
 };
 
+static const cyaml_schema_value_t bit_name_schema = {
+    CYAML_VALUE_STRING(CYAML_FLAG_POINTER, char, 0, CYAML_UNLIMITED)
+};
+
 static const cyaml_schema_field_t metric_fields[] = {
     CYAML_FIELD_ENUM(
         "metricType", CYAML_FLAG_DEFAULT,
-        struct metric, metric_type, metric_type_strings,
+        struct metric_config, metric_type, metric_type_strings,
         CYAML_ARRAY_LEN(metric_type_strings)),
     CYAML_FIELD_ENUM(
         "inputType", CYAML_FLAG_DEFAULT,
-        struct metric, input_type, input_type_strings,
+        struct metric_config, input_type, input_type_strings,
         CYAML_ARRAY_LEN(input_type_strings)),
     CYAML_FIELD_ENUM(
         "dataType", CYAML_FLAG_DEFAULT,
-        struct metric, data_type, data_type_strings,
+        struct metric_config, data_type, data_type_strings,
         CYAML_ARRAY_LEN(data_type_strings)),
     CYAML_FIELD_ENUM(
         "wordOrder", CYAML_FLAG_DEFAULT|CYAML_FLAG_OPTIONAL,
-        struct metric, word_order, word_order_strings,
+        struct metric_config, word_order, word_order_strings,
         CYAML_ARRAY_LEN(word_order_strings)),
-    CYAML_FIELD_UINT(
-        "address", CYAML_FLAG_DEFAULT,
-        struct metric, address),
+    CYAML_FIELD_UINT_PTR(
+        "address", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+        struct metric_config, address),
     CYAML_FIELD_STRING_PTR(
         "name", CYAML_FLAG_POINTER,
-        struct metric, name, 0, CYAML_UNLIMITED),
+        struct metric_config, name, 0, CYAML_UNLIMITED),
     CYAML_FIELD_STRING_PTR(
         "help", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
-        struct metric, help, 0, CYAML_UNLIMITED),
+        struct metric_config, help, 0, CYAML_UNLIMITED),
     CYAML_FIELD_FLOAT(
         "factor", CYAML_FLAG_OPTIONAL,
-        struct metric, factor),
+        struct metric_config, factor),
+    CYAML_FIELD_STRING_PTR(
+        "expression", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+        struct metric_config, expression, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE(
+        "bits", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+        struct metric_config, bits,
+        &bit_name_schema, 0, 32),
+    CYAML_FIELD_FLOAT(
+        "deadband", CYAML_FLAG_OPTIONAL,
+        struct metric_config, deadband),
     CYAML_FIELD_END
 };
 
 static const cyaml_schema_value_t metric_schema = {
-    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct metric, metric_fields)
+    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct metric_config, metric_fields)
+};
+
+static const cyaml_schema_value_t group_metric_schema = {
+    CYAML_VALUE_STRING(CYAML_FLAG_POINTER, char, 0, CYAML_UNLIMITED)
+};
+
+static const cyaml_schema_field_t group_fields[] = {
+    CYAML_FIELD_STRING_PTR(
+        "name", CYAML_FLAG_POINTER,
+        struct group_config, name, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE(
+        "metrics", CYAML_FLAG_POINTER,
+        struct group_config, metrics,
+        &group_metric_schema, 1, CYAML_UNLIMITED),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t group_schema = {
+    CYAML_VALUE_MAPPING(
+        CYAML_FLAG_DEFAULT,
+        struct group_config, group_fields)
+};
+
+static const cyaml_strval_t checksum_type_strings[] = {
+    { "none", CHECKSUM_NONE },
+    { "crc16", CHECKSUM_CRC16 },
+    { "sum8", CHECKSUM_SUM8 },
+    { "xor8", CHECKSUM_XOR8 }
+};
+
+static const cyaml_schema_value_t frame_byte_schema = {
+    CYAML_VALUE_UINT(CYAML_FLAG_DEFAULT, unsigned int)
+};
+
+static const cyaml_schema_field_t length_field_fields[] = {
+    CYAML_FIELD_UINT(
+        "offset", CYAML_FLAG_DEFAULT,
+        struct length_field_config, offset),
+    CYAML_FIELD_UINT(
+        "size", CYAML_FLAG_DEFAULT,
+        struct length_field_config, size),
+    CYAML_FIELD_INT(
+        "adjust", CYAML_FLAG_OPTIONAL,
+        struct length_field_config, adjust),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_field_t frame_fields[] = {
+    CYAML_FIELD_SEQUENCE(
+        "request", CYAML_FLAG_POINTER|CYAML_FLAG_FLOW,
+        struct frame_config, request,
+        &frame_byte_schema, 1, FRAME_MAX_REQUEST),
+    CYAML_FIELD_UINT_PTR(
+        "targetOffset", CYAML_FLAG_OPTIONAL,
+        struct frame_config, target_offset),
+    CYAML_FIELD_SEQUENCE(
+        "start", CYAML_FLAG_POINTER|CYAML_FLAG_FLOW|CYAML_FLAG_OPTIONAL,
+        struct frame_config, start,
+        &frame_byte_schema, 0, FRAME_MAX_MARKER),
+    CYAML_FIELD_UINT(
+        "length", CYAML_FLAG_OPTIONAL,
+        struct frame_config, length),
+    CYAML_FIELD_MAPPING_PTR(
+        "lengthField", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+        struct frame_config, length_field, length_field_fields),
+    CYAML_FIELD_ENUM(
+        "checksum", CYAML_FLAG_OPTIONAL,
+        struct frame_config, checksum, checksum_type_strings,
+        CYAML_ARRAY_LEN(checksum_type_strings)),
+    CYAML_FIELD_UINT(
+        "timeout", CYAML_FLAG_OPTIONAL,
+        struct frame_config, timeout),
+    CYAML_FIELD_UINT(
+        "byteTimeout", CYAML_FLAG_OPTIONAL,
+        struct frame_config, byte_timeout),
+    CYAML_FIELD_END
 };
 
 static const cyaml_strval_t module_type_strings[] = {
     { "modbus", MODULE_TYPE_MODBUS },
-    { "tbb-inverter", MODULE_TYPE_TBB_INVERTER }
+    { "tbb-inverter", MODULE_TYPE_TBB_INVERTER },
+    { "framed", MODULE_TYPE_FRAMED }
 };
 
 static const cyaml_schema_field_t module_fields[] = {
     CYAML_FIELD_STRING_PTR(
         "name", CYAML_FLAG_POINTER,
-        struct module, name, 0, CYAML_UNLIMITED),
+        struct module_config, name, 0, CYAML_UNLIMITED),
     CYAML_FIELD_ENUM(
         "moduleType", CYAML_FLAG_DEFAULT,
-        struct module, module_type, module_type_strings,
+        struct module_config, module_type, module_type_strings,
         CYAML_ARRAY_LEN(module_type_strings)),
+    CYAML_FIELD_UINT(
+        "maxReadGap", CYAML_FLAG_OPTIONAL,
+        struct module_config, max_read_gap),
     CYAML_FIELD_SEQUENCE(
         "metrics", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
-        struct module, metrics,
+        struct module_config, metrics,
         &metric_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE(
+        "groups", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct module_config, groups,
+        &group_schema, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_MAPPING_PTR(
+        "frame", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
+        struct module_config, frame, frame_fields),
     CYAML_FIELD_END
 };
 
 static const cyaml_schema_value_t module_schema = {
     CYAML_VALUE_MAPPING(
         CYAML_FLAG_POINTER,
-        struct module, module_fields)
+        struct module_config, module_fields)
+};
+
+static const cyaml_schema_field_t poll_fields[] = {
+    CYAML_FIELD_STRING_PTR(
+        "module", CYAML_FLAG_POINTER,
+        struct poll_config, module, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT(
+        "target", CYAML_FLAG_DEFAULT,
+        struct poll_config, target),
+    CYAML_FIELD_UINT(
+        "interval", CYAML_FLAG_OPTIONAL,
+        struct poll_config, interval),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t poll_schema = {
+    CYAML_VALUE_MAPPING(
+        CYAML_FLAG_DEFAULT,
+        struct poll_config, poll_fields)
+};
+
+static const cyaml_schema_field_t fleet_target_fields[] = {
+    CYAML_FIELD_STRING_PTR(
+        "module", CYAML_FLAG_POINTER,
+        struct poll_config, module, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT(
+        "target", CYAML_FLAG_DEFAULT,
+        struct poll_config, target),
+    CYAML_FIELD_END
+};
+
+static const cyaml_schema_value_t fleet_target_schema = {
+    CYAML_VALUE_MAPPING(
+        CYAML_FLAG_DEFAULT,
+        struct poll_config, fleet_target_fields)
+};
+
+static const cyaml_schema_field_t fleet_fields[] = {
+    CYAML_FIELD_UINT(
+        "interval", CYAML_FLAG_OPTIONAL,
+        struct fleet_config, interval),
+    CYAML_FIELD_SEQUENCE(
+        "targets", CYAML_FLAG_POINTER,
+        struct fleet_config, targets,
+        &fleet_target_schema, 1, CYAML_UNLIMITED),
+    CYAML_FIELD_END
 };
 
 static const cyaml_schema_field_t modules_fields[] = {
         CYAML_FIELD_SEQUENCE(
                 "modules", CYAML_FLAG_POINTER,
-                struct modules, modules,
+                struct modules_config, modules,
                 &module_schema, 0, CYAML_UNLIMITED),
+        CYAML_FIELD_SEQUENCE(
+                "poll", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+                struct modules_config, polls,
+                &poll_schema, 0, CYAML_UNLIMITED),
+        CYAML_FIELD_MAPPING_PTR(
+                "fleet", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+                struct modules_config, fleet, fleet_fields),
         CYAML_FIELD_END
 };
 
 static const cyaml_schema_value_t modules_schema = {
         CYAML_VALUE_MAPPING(
                 CYAML_FLAG_POINTER,
-                struct modules, modules_fields)
+                struct modules_config, modules_fields)
 };
 
+#define DEFAULT_POLL_INTERVAL   15
+
 static cyaml_config_t cyaml_config = {
         .log_fn = cyaml_log,
         .mem_fn = cyaml_mem,
         .log_level = CYAML_LOG_WARNING
 };
 
+/* FNV-1a, used for both string interning and module lookup */
+static uint32_t hash_string(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static unsigned int hash_table_size(unsigned int count)
+{
+    unsigned int size = 4;
+
+    while (size < count * 2)
+        size <<= 1;
+    return size;
+}
+
+/* String table used while building the run-time configuration. Identical
+ * strings (e.g. the same metric name across modules, or repeating help text)
+ * are stored only once.
+ */
+typedef struct strtab {
+    char *buf;
+    size_t len;
+    size_t size;
+    uint32_t *slots;            /* Offset + 1, zero is empty */
+    unsigned int slots_size;
+} strtab_t;
+
+static int strtab_init(strtab_t *t, unsigned int max_strings)
+{
+    t->buf = NULL;
+    t->len = t->size = 0;
+    t->slots_size = hash_table_size(max_strings);
+    t->slots = calloc(t->slots_size, sizeof(uint32_t));
+
+    return t->slots ? 0 : -1;
+}
+
+static void strtab_free(strtab_t *t)
+{
+    free(t->buf);
+    free(t->slots);
+}
+
+static int strtab_intern(strtab_t *t, const char *s, uint32_t *offset)
+{
+    unsigned int mask = t->slots_size - 1;
+    unsigned int i = hash_string(s) & mask;
+
+    while (t->slots[i]) {
+        if (!strcmp(t->buf + t->slots[i] - 1, s)) {
+            *offset = t->slots[i] - 1;
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+
+    size_t slen = strlen(s) + 1;
+    if (t->len + slen > t->size) {
+        size_t new_size = t->size ? t->size * 2 : 1024;
+        while (new_size < t->len + slen)
+            new_size *= 2;
+
+        char *new_buf = realloc(t->buf, new_size);
+        if (!new_buf)
+            return -1;
+        t->buf = new_buf;
+        t->size = new_size;
+    }
+
+    memcpy(t->buf + t->len, s, slen);
+    *offset = t->len;
+    t->slots[i] = t->len + 1;
+    t->len += slen;
+
+    return 0;
+}
+
+static int intern_config_strings(strtab_t *t, modules_config_t *config)
+{
+    uint32_t offset;
+
+    for (int i = 0; i < config->modules_count; i++) {
+        module_config_t *mc = config->modules[i];
+
+        if (strtab_intern(t, mc->name, &offset) < 0)
+            return -1;
+        for (int j = 0; j < mc->metrics_count; j++) {
+            if (strtab_intern(t, mc->metrics[j]->name, &offset) < 0)
+                return -1;
+            if (mc->metrics[j]->help &&
+                strtab_intern(t, mc->metrics[j]->help, &offset) < 0)
+                return -1;
+            if (mc->metrics[j]->expression &&
+                strtab_intern(t, mc->metrics[j]->expression, &offset) < 0)
+                return -1;
+            for (int k = 0; k < mc->metrics[j]->bits_count; k++) {
+                if (strtab_intern(t, mc->metrics[j]->bits[k], &offset) < 0)
+                    return -1;
+            }
+        }
+        for (int j = 0; j < mc->groups_count; j++) {
+            if (strtab_intern(t, mc->groups[j].name, &offset) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Look up an already interned string, and return its run-time location */
+static const char *lookup_string(strtab_t *t, const char *strings, const char *s)
+{
+    uint32_t offset;
+
+    if (!s)
+        return NULL;
+    strtab_intern(t, s, &offset);
+    return strings + offset;
+}
+
+static int metric_convert(const char *filename, module_config_t *mc,
+                          metric_config_t *c, metric_t *metric)
+{
+    if ((c->input_type == INPUT_TYPE_DERIVED) != (c->expression != NULL)) {
+        fprintf(stderr, "%s: %s: metric %s: expression must be used with derived metrics\n",
+                filename, mc->name, c->name);
+        return -1;
+    }
+
+    if (c->bits_count) {
+        unsigned int max_bits = (c->data_type == DATA_TYPE_INT32 ||
+                                 c->data_type == DATA_TYPE_UINT32) ? 32 : 16;
+        if (c->input_type == INPUT_TYPE_COIL || c->input_type == INPUT_TYPE_DISCRETE_INPUT ||
+            c->data_type == DATA_TYPE_FLOAT16 || c->data_type == DATA_TYPE_FLOAT32 ||
+            c->bits_count > max_bits) {
+            fprintf(stderr, "%s: %s: metric %s: invalid bits\n", filename, mc->name, c->name);
+            return -1;
+        }
+    }
+
+    /* Framed modules only have a frame to decode metrics from */
+    int framed = mc->module_type == MODULE_TYPE_FRAMED ||
+                 mc->module_type == MODULE_TYPE_TBB_INVERTER;
+    if ((c->input_type == INPUT_TYPE_PAYLOAD_OFFSET && !framed) ||
+        (framed && c->input_type != INPUT_TYPE_PAYLOAD_OFFSET && c->input_type != INPUT_TYPE_DERIVED)) {
+        fprintf(stderr, "%s: %s: metric %s: input type %s is not supported by module\n",
+                filename, mc->name, c->name, get_input_type_str(c->input_type));
+        return -1;
+    }
+
+    if (c->deadband < 0) {
+        fprintf(stderr, "%s: %s: metric %s: invalid deadband\n", filename, mc->name, c->name);
+        return -1;
+    }
+
+    if (c->input_type != INPUT_TYPE_DERIVED && !c->address) {
+        fprintf(stderr, "%s: %s: metric %s: missing address\n", filename, mc->name, c->name);
+        return -1;
+    }
+    if (c->input_type == INPUT_TYPE_DERIVED && c->address) {
+        fprintf(stderr, "%s: %s: metric %s: derived metrics have no address\n",
+                filename, mc->name, c->name);
+        return -1;
+    }
+
+    if (c->address && *c->address > UINT16_MAX) {
+        fprintf(stderr, "%s: %s: metric %s: invalid address %u\n",
+                filename, mc->name, c->name, *c->address);
+        return -1;
+    }
+
+    metric->address = c->address ? *c->address : 0;
+    metric->factor = c->factor;
+    metric->input_type = c->input_type;
+    metric->metric_type = c->metric_type;
+    metric->data_type = c->data_type;
+    metric->word_order = c->word_order;
+    metric->bitfield = c->bits_count > 0;
+
+    return 0;
+}
+
+typedef struct resolve_ctx {
+    module_config_t *mc;
+    int self;
+} resolve_ctx_t;
+
+/* Derived metrics may refer to any register metric of their module, but only
+ * to derived metrics that precede them, as they are evaluated in order.
+ */
+static int resolve_metric(void *ctx, const char *name, size_t len)
+{
+    resolve_ctx_t *rc = (resolve_ctx_t *) ctx;
+
+    for (int i = 0; i < rc->mc->metrics_count; i++) {
+        metric_config_t *c = rc->mc->metrics[i];
+        if (strlen(c->name) != len || strncmp(c->name, name, len) != 0)
+            continue;
+        if (i == rc->self || (c->input_type == INPUT_TYPE_DERIVED && i > rc->self))
+            return -1;
+        return i;
+    }
+
+    return -1;
+}
+
+/* Compile all derived metric expressions, in order, into a single array */
+static int compile_exprs(const char *filename, modules_config_t *config, expr_op_t **code,
+                         unsigned int *code_len, unsigned int **lens, unsigned int *exprs_count)
+{
+    *code = NULL;
+    *lens = NULL;
+    *code_len = *exprs_count = 0;
+
+    for (int i = 0; i < config->modules_count; i++) {
+        module_config_t *mc = config->modules[i];
+
+        for (int j = 0; j < mc->metrics_count; j++) {
+            metric_config_t *c = mc->metrics[j];
+            if (c->input_type != INPUT_TYPE_DERIVED || !c->expression)
+                continue;
+
+            resolve_ctx_t rc = { .mc = mc, .self = j };
+            expr_op_t ops[EXPR_MAX_OPS];
+            unsigned int len;
+            char err[128];
+
+            if (expr_compile(c->expression, resolve_metric, &rc, ops, &len, err, sizeof(err)) < 0) {
+                fprintf(stderr, "%s: %s: metric %s: %s\n", filename, mc->name, c->name, err);
+                return -1;
+            }
+
+            expr_op_t *new_code = realloc(*code, (*code_len + len) * sizeof(expr_op_t));
+            if (new_code)
+                *code = new_code;
+            unsigned int *new_lens = realloc(*lens, (*exprs_count + 1) * sizeof(unsigned int));
+            if (new_lens)
+                *lens = new_lens;
+            if (!new_code || !new_lens) {
+                fprintf(stderr, "%s: out of memory\n", filename);
+                return -1;
+            }
+
+            memcpy(*code + *code_len, ops, len * sizeof(expr_op_t));
+            *code_len += len;
+            (*lens)[(*exprs_count)++] = len;
+        }
+    }
+
+    return 0;
+}
+
+static int find_metric(module_t *module, const char *name)
+{
+    for (int i = 0; i < module->metrics_count; i++) {
+        if (!strcmp(module->metrics[i].name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+/* Convert the configuration loaded by cyaml to the compact run-time form */
+static modules_t *modules_build(const char *filename, modules_config_t *config)
+{
+    modules_t *modules = NULL;
+    unsigned int metrics_count = 0;
+    unsigned int bitfields_count = 0, bit_names_count = 0;
+    unsigned int groups_count = 0;
+    unsigned int frames_count = 0;
+    unsigned int deadbands_count = 0;
+    unsigned int fleet_count = config->fleet ? config->fleet->targets_count : 0;
+    size_t selects_len = 0;
+    expr_op_t *code = NULL;
+    unsigned int *expr_lens = NULL;
+    unsigned int code_len, exprs_count;
+    strtab_t strtab;
+
+    for (int i = 0; i < config->modules_count; i++) {
+        module_config_t *mc = config->modules[i];
+
+        metrics_count += mc->metrics_count;
+        groups_count += mc->groups_count;
+        frames_count += mc->module_type == MODULE_TYPE_FRAMED;
+        for (int j = 0; j < mc->metrics_count; j++) {
+            if (mc->metrics[j]->deadband != 0) {
+                deadbands_count += mc->metrics_count;
+                break;
+            }
+        }
+        selects_len += (size_t) mc->groups_count * mc->metrics_count;
+        for (int j = 0; j < mc->metrics_count; j++) {
+            if (mc->metrics[j]->bits_count) {
+                bitfields_count++;
+                bit_names_count += mc->metrics[j]->bits_count;
+            }
+        }
+    }
+
+    if (strtab_init(&strtab, config->modules_count + metrics_count * 3 + bit_names_count +
+                             groups_count) < 0 ||
+        intern_config_strings(&strtab, config) < 0) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+        goto done;
+    }
+
+    if (compile_exprs(filename, config, &code, &code_len, &expr_lens, &exprs_count) < 0)
+        goto done;
+
+    unsigned int index_size = hash_table_size(config->modules_count);
+    size_t mem_size = sizeof(modules_t) +
+            config->modules_count * sizeof(module_t) +
+            metrics_count * sizeof(metric_t) +
+            config->polls_count * sizeof(poll_t) +
+            fleet_count * sizeof(poll_t) +
+            exprs_count * sizeof(expr_t) +
+            code_len * sizeof(expr_op_t) +
+            bitfields_count * sizeof(bitfield_t) +
+            bit_names_count * sizeof(const char *) +
+            frames_count * sizeof(frame_t) +
+            groups_count * sizeof(metric_group_t) +
+            index_size * sizeof(uint32_t) +
+            deadbands_count * sizeof(float) +
+            strtab.len +
+            selects_len;
+
+    char *mem = calloc(1, mem_size);
+    if (!mem) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+        goto done;
+    }
+
+    modules = (modules_t *) mem;
+    modules->mem_size = mem_size;
+    modules->modules_count = config->modules_count;
+    modules->modules = (module_t *) (mem + sizeof(modules_t));
+    modules->metrics_count = metrics_count;
+    modules->metrics = (metric_t *) (modules->modules + modules->modules_count);
+    modules->polls_count = config->polls_count;
+    modules->polls = (poll_t *) (modules->metrics + metrics_count);
+    modules->fleet_count = fleet_count;
+    modules->fleet = modules->polls + modules->polls_count;
+    modules->index_size = index_size;
+    modules->exprs_count = exprs_count;
+    modules->exprs = (expr_t *) (modules->fleet + fleet_count);
+    modules->code_len = code_len;
+    modules->code = (expr_op_t *) (modules->exprs + exprs_count);
+    if (code_len)
+        memcpy(modules->code, code, code_len * sizeof(expr_op_t));
+    modules->bitfields_count = bitfields_count;
+    modules->bitfields = (bitfield_t *) (modules->code + code_len);
+    modules->bit_names_count = bit_names_count;
+    modules->bit_names = (const char **) (modules->bitfields + bitfields_count);
+    modules->frames_count = frames_count;
+    modules->frames = (frame_t *) (modules->bit_names + bit_names_count);
+    modules->groups_count = groups_count;
+    modules->groups = (metric_group_t *) (modules->frames + frames_count);
+    modules->index = (uint32_t *) (modules->groups + groups_count);
+    modules->deadbands_count = deadbands_count;
+    modules->deadbands = (float *) (modules->index + index_size);
+    modules->strings_len = strtab.len;
+    modules->strings = (const char *) (modules->deadbands + deadbands_count);
+    memcpy((char *) modules->strings, strtab.buf, strtab.len);
+
+    metric_t *metric = modules->metrics;
+    expr_t *expr = modules->exprs;
+    expr_op_t *expr_code = modules->code;
+    bitfield_t *bitfield = modules->bitfields;
+    const char **bit_name = modules->bit_names;
+    frame_t *frame = modules->frames;
+    metric_group_t *group = modules->groups;
+    float *deadband = modules->deadbands;
+    uint8_t *select = (uint8_t *) modules->strings + strtab.len;
+    for (int i = 0; i < config->modules_count; i++) {
+        module_config_t *mc = config->modules[i];
+        module_t *module = &modules->modules[i];
+
+        module->name = lookup_string(&strtab, modules->strings, mc->name);
+        module->module_type = mc->module_type;
+        module->max_read_gap = mc->max_read_gap;
+        module->metrics = metric;
+        module->metrics_count = mc->metrics_count;
+
+        if ((mc->module_type == MODULE_TYPE_FRAMED) != (mc->frame != NULL)) {
+            fprintf(stderr, "%s: %s: frame must be used with framed modules\n", filename, mc->name);
+            goto error;
+        }
+        if (mc->module_type == MODULE_TYPE_TBB_INVERTER) {
+            module->frame = &tbb_frame;
+        } else if (mc->module_type == MODULE_TYPE_FRAMED) {
+            char err[128];
+
+            if (frame_compile(mc->frame, frame, err, sizeof(err)) < 0) {
+                fprintf(stderr, "%s: %s: frame: %s\n", filename, mc->name, err);
+                goto error;
+            }
+            module->frame = frame++;
+        }
+
+        for (int j = 0; j < mc->metrics_count; j++) {
+            if (mc->metrics[j]->deadband != 0) {
+                module->deadbands = deadband;
+                deadband += mc->metrics_count;
+                break;
+            }
+        }
+
+        for (int j = 0; j < mc->metrics_count; j++, metric++) {
+            metric->name = lookup_string(&strtab, modules->strings, mc->metrics[j]->name);
+            metric->help = lookup_string(&strtab, modules->strings, mc->metrics[j]->help);
+            if (metric_convert(filename, mc, mc->metrics[j], metric) < 0)
+                goto error;
+            if (module->deadbands)
+                module->deadbands[j] = mc->metrics[j]->deadband;
+
+            /* Fixed length frames are known to hold the whole value */
+            unsigned int width = (metric->data_type == DATA_TYPE_INT32 ||
+                                  metric->data_type == DATA_TYPE_UINT32 ||
+                                  metric->data_type == DATA_TYPE_FLOAT32) ? 4 : 2;
+            if (metric->input_type == INPUT_TYPE_PAYLOAD_OFFSET && module->frame->length &&
+                metric->address + width > module->frame->length) {
+                fprintf(stderr, "%s: %s: metric %s: offset %u is outside the frame\n",
+                        filename, mc->name, metric->name, metric->address);
+                goto error;
+            }
+
+            if (metric->input_type == INPUT_TYPE_DERIVED) {
+                expr->source = lookup_string(&strtab, modules->strings, mc->metrics[j]->expression);
+                expr->code = expr_code;
+                expr->code_len = expr_lens[expr - modules->exprs];
+                expr_code += expr->code_len;
+                metric->address = expr - modules->exprs;
+                expr++;
+            }
+
+            if (metric->bitfield) {
+                metric_config_t *c = mc->metrics[j];
+
+                bitfield->metric = metric;
+                bitfield->names = bit_name;
+                bitfield->count = c->bits_count;
+                for (int k = 0; k < c->bits_count; k++, bit_name++) {
+                    if (c->bits[k][0])
+                        *bit_name = lookup_string(&strtab, modules->strings, c->bits[k]);
+                }
+                bitfield++;
+            }
+        }
+
+        module->groups = group;
+        for (int j = 0; j < mc->groups_count; j++, group++, select += module->metrics_count) {
+            group_config_t *gc = &mc->groups[j];
+
+            group->name = lookup_string(&strtab, modules->strings, gc->name);
+            group->select = select;
+            if (modules_get_group(module, group->name) || find_metric(module, group->name) >= 0) {
+                fprintf(stderr, "%s: %s: duplicate group name %s\n", filename, mc->name, gc->name);
+                goto error;
+            }
+            for (int k = 0; k < gc->metrics_count; k++) {
+                int m = find_metric(module, gc->metrics[k]);
+                if (m < 0) {
+                    fprintf(stderr, "%s: %s: group %s: unknown metric %s\n",
+                            filename, mc->name, gc->name, gc->metrics[k]);
+                    goto error;
+                }
+                select[m] = SELECT_EXPORTED;
+            }
+            module->groups_count++;
+        }
+
+        uint32_t mask = index_size - 1;
+        uint32_t slot = hash_string(module->name) & mask;
+        while (modules->index[slot]) {
+            if (!strcmp(modules->modules[modules->index[slot] - 1].name, module->name)) {
+                fprintf(stderr, "%s: duplicate module %s\n", filename, module->name);
+                goto error;
+            }
+            slot = (slot + 1) & mask;
+        }
+        modules->index[slot] = i + 1;
+    }
+
+    for (int i = 0; i < config->polls_count; i++) {
+        poll_config_t *pc = &config->polls[i];
+        poll_t *poll = &modules->polls[i];
+
+        if (!(poll->module = modules_get_module(modules, pc->module))) {
+            fprintf(stderr, "%s: poll: unknown module %s\n", filename, pc->module);
+            goto error;
+        }
+        if (pc->target < 1 || pc->target > MAX_TARGET) {
+            fprintf(stderr, "%s: poll: %s: invalid target %u\n", filename, pc->module, pc->target);
+            goto error;
+        }
+        poll->target = pc->target;
+        poll->interval = pc->interval ? pc->interval : DEFAULT_POLL_INTERVAL;
+    }
+
+    for (int i = 0; i < fleet_count; i++) {
+        poll_config_t *pc = &config->fleet->targets[i];
+        poll_t *member = &modules->fleet[i];
+
+        if (!(member->module = modules_get_module(modules, pc->module))) {
+            fprintf(stderr, "%s: fleet: unknown module %s\n", filename, pc->module);
+            goto error;
+        }
+        if (pc->target < 1 || pc->target > MAX_TARGET) {
+            fprintf(stderr, "%s: fleet: %s: invalid target %u\n", filename, pc->module, pc->target);
+            goto error;
+        }
+        for (int j = 0; j < i; j++) {
+            if (modules->fleet[j].module == member->module && modules->fleet[j].target == pc->target) {
+                fprintf(stderr, "%s: fleet: %s: duplicate target %u\n", filename, pc->module,
+                        pc->target);
+                goto error;
+            }
+        }
+        member->target = pc->target;
+        member->interval = config->fleet->interval ? config->fleet->interval : DEFAULT_POLL_INTERVAL;
+    }
+
+    for (int i = 0; i < modules->modules_count; i++) {
+        module_t *module = &modules->modules[i];
+
+        if (!(module->plan = read_plan_build(module, NULL, module->max_read_gap, NULL, 0))) {
+            fprintf(stderr, "%s: out of memory\n", filename);
+            goto error;
+        }
+        modules->mem_size += module->plan->size;
+
+        for (int j = 0; j < module->groups_count; j++) {
+            if (modules_group_build(modules, module, &module->groups[j]) < 0) {
+                fprintf(stderr, "%s: out of memory\n", filename);
+                goto error;
+            }
+            modules->mem_size += module->groups[j].plan->size;
+        }
+    }
+
+done:
+    strtab_free(&strtab);
+    free(code);
+    free(expr_lens);
+    return modules;
+
+error:
+    modules_free(modules);
+    modules = NULL;
+    goto done;
+}
+
 modules_t *modules_load(const char *filename)
 {
-    modules_t *modules;
+    modules_config_t *config;
 
     cyaml_err_t err = cyaml_load_file(filename, &cyaml_config,
-                                      &modules_schema, (void **) &modules, NULL);
+                                      &modules_schema, (void **) &config, NULL);
     if (err != CYAML_OK) {
         fprintf(stderr, "%s: %s\n", filename, cyaml_strerror(err));
         return NULL;
     }
 
+    modules_t *modules = modules_build(filename, config);
+    cyaml_free(&cyaml_config, &modules_schema, config, 0);
+
     return modules;
 }
 
-int modules_dump(modules_t *modules, char **output, size_t *len)
+void modules_free(modules_t *modules)
 {
-    cyaml_err_t err = cyaml_save_data(output, len, &cyaml_config,
-                    &modules_schema, modules, 0);
-    if (err != CYAML_OK)
+    for (int i = 0; i < modules->modules_count; i++) {
+        if (modules->modules[i].plan)
+            read_plan_free(modules->modules[i].plan);
+    }
+    for (int i = 0; i < modules->groups_count; i++) {
+        if (modules->groups[i].plan)
+            read_plan_free(modules->groups[i].plan);
+    }
+    free(modules);
+}
+
+metric_group_t *modules_get_group(module_t *module, const char *name)
+{
+    for (int i = 0; i < module->groups_count; i++) {
+        if (!strcmp(module->groups[i].name, name))
+            return &module->groups[i];
+    }
+
+    return NULL;
+}
+
+/* Returns an empty ad-hoc group, with the selection in the same allocation */
+metric_group_t *modules_group_new(module_t *module)
+{
+    metric_group_t *group = calloc(1, sizeof(metric_group_t) + module->metrics_count);
+    if (!group)
+        return NULL;
+
+    group->select = (uint8_t *) (group + 1);
+    return group;
+}
+
+/* Adds a metric, or all metrics of a configured group, to an ad-hoc group */
+int modules_group_add(module_t *module, metric_group_t *group, const char *name)
+{
+    metric_group_t *named = modules_get_group(module, name);
+    if (named) {
+        for (int i = 0; i < module->metrics_count; i++) {
+            if (named->select[i] == SELECT_EXPORTED)
+                group->select[i] = SELECT_EXPORTED;
+        }
+        return 0;
+    }
+
+    int i = find_metric(module, name);
+    if (i < 0)
         return -1;
+
+    group->select[i] = SELECT_EXPORTED;
     return 0;
 }
 
-module_t *modules_get_module(modules_t *modules, const char *name)
+/* Adds the operands of selected derived metrics to the selection, and builds
+ * the read plan. Derived metrics only refer to derived metrics before them,
+ * so a single backwards pass is enough.
+ */
+int modules_group_build(modules_t *modules, module_t *module, metric_group_t *group)
+{
+    for (int i = module->metrics_count - 1; i >= 0; i--) {
+        metric_t *metric = &module->metrics[i];
+        if (!group->select[i] || metric->input_type != INPUT_TYPE_DERIVED)
+            continue;
+
+        expr_t *expr = &modules->exprs[metric->address];
+        for (int j = 0; j < expr->code_len; j++) {
+            if (expr->code[j].opcode == EXPR_OP_METRIC && !group->select[expr->code[j].metric])
+                group->select[expr->code[j].metric] = SELECT_OPERAND;
+        }
+    }
+
+    group->plan = read_plan_build(module, group->select, module->max_read_gap, NULL, 0);
+    return group->plan ? 0 : -1;
+}
+
+/* Frees an ad-hoc group, groups from the configuration are left alone */
+void modules_group_free(metric_group_t *group)
+{
+    if (group->name)
+        return;
+    if (group->plan)
+        read_plan_free(group->plan);
+    free(group);
+}
+
+/* Bitfields are stored in metric order, so they can be searched by address */
+const bitfield_t *modules_get_bitfield(modules_t *modules, const metric_t *metric)
+{
+    unsigned int lo = 0, hi = modules->bitfields_count;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        const bitfield_t *bitfield = &modules->bitfields[mid];
+
+        if (bitfield->metric == metric)
+            return bitfield;
+        if (bitfield->metric < metric)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/* Reconstruct the cyaml configuration structures (pointing at the interned
+ * strings) only for the duration of the dump.
+ */
+typedef struct frame_dump {
+    frame_config_t config;
+    unsigned int request[FRAME_MAX_REQUEST];
+    unsigned int start[FRAME_MAX_MARKER];
+    unsigned int target_offset;
+    length_field_config_t length_field;
+} frame_dump_t;
+
+int modules_dump(modules_t *modules, char **output, size_t *len)
 {
+    int ret = -1;
+    modules_config_t config = {
+        .modules_count = modules->modules_count
+    };
+    module_config_t *mcs = calloc(modules->modules_count, sizeof(module_config_t));
+    module_config_t **mcps = calloc(modules->modules_count, sizeof(module_config_t *));
+    metric_config_t *cs = calloc(modules->metrics_count, sizeof(metric_config_t));
+    unsigned int *addresses = calloc(modules->metrics_count, sizeof(unsigned int));
+    metric_config_t **cps = calloc(modules->metrics_count, sizeof(metric_config_t *));
+    char **bits = calloc(modules->bit_names_count, sizeof(char *));
+    poll_config_t *pcs = calloc(modules->polls_count, sizeof(poll_config_t));
+    group_config_t *gcs = calloc(modules->groups_count, sizeof(group_config_t));
+    frame_dump_t *fds = calloc(modules->frames_count, sizeof(frame_dump_t));
+    poll_config_t *fleet_targets = calloc(modules->fleet_count, sizeof(poll_config_t));
+    fleet_config_t fleet = { .targets = fleet_targets, .targets_count = modules->fleet_count };
+    size_t group_metrics_count = 0;
+
+    for (int i = 0; i < modules->modules_count; i++) {
+        module_t *module = &modules->modules[i];
+        for (int j = 0; j < module->groups_count; j++) {
+            for (int k = 0; k < module->metrics_count; k++)
+                group_metrics_count += module->groups[j].select[k] == SELECT_EXPORTED;
+        }
+    }
+    char **group_metrics = calloc(group_metrics_count, sizeof(char *));
+
+    if ((modules->modules_count && (!mcs || !mcps)) ||
+        (modules->metrics_count && (!cs || !cps || !addresses)) ||
+        (modules->bit_names_count && !bits) ||
+        (modules->polls_count && !pcs) ||
+        (modules->groups_count && !gcs) ||
+        (modules->frames_count && !fds) ||
+        (modules->fleet_count && !fleet_targets) ||
+        (group_metrics_count && !group_metrics))
+        goto done;
+
+    config.polls = pcs;
+    config.polls_count = modules->polls_count;
+    for (int i = 0; i < modules->polls_count; i++) {
+        pcs[i].module = (char *) modules->polls[i].module->name;
+        pcs[i].target = modules->polls[i].target;
+        pcs[i].interval = modules->polls[i].interval;
+    }
+
+    if (modules->fleet_count) {
+        config.fleet = &fleet;
+        fleet.interval = modules->fleet[0].interval;
+        for (int i = 0; i < modules->fleet_count; i++) {
+            fleet_targets[i].module = (char *) modules->fleet[i].module->name;
+            fleet_targets[i].target = modules->fleet[i].target;
+        }
+    }
+
+    config.modules = mcps;
+    char **group_metric = group_metrics;
     for (int i = 0; i < modules->modules_count; i++) {
-        if (!strcmp(modules->modules[i]->name, name))
-            return modules->modules[i];
+        module_t *module = &modules->modules[i];
+        module_config_t *mc = &mcs[i];
+
+        mcps[i] = mc;
+        mc->name = (char *) module->name;
+        mc->module_type = module->module_type;
+        mc->max_read_gap = module->max_read_gap;
+        mc->metrics_count = module->metrics_count;
+        mc->metrics = cps + (module->metrics - modules->metrics);
+        if (module->module_type == MODULE_TYPE_FRAMED) {
+            frame_dump_t *fd = &fds[module->frame - modules->frames];
+
+            frame_to_config(module->frame, &fd->config, fd->request, fd->start,
+                            &fd->target_offset, &fd->length_field);
+            mc->frame = &fd->config;
+        }
+
+        for (int j = 0; j < module->metrics_count; j++) {
+            metric_t *metric = &module->metrics[j];
+            metric_config_t *c = &cs[metric - modules->metrics];
+
+            mc->metrics[j] = c;
+            c->name = (char *) metric->name;
+            c->help = (char *) metric->help;
+            c->factor = metric->factor;
+            c->input_type = metric->input_type;
+            c->metric_type = metric->metric_type;
+            c->data_type = metric->data_type;
+            c->word_order = metric->word_order;
+            if (module->deadbands)
+                c->deadband = module->deadbands[j];
+            if (metric->input_type == INPUT_TYPE_DERIVED) {
+                c->expression = (char *) modules->exprs[metric->address].source;
+            } else {
+                c->address = &addresses[metric - modules->metrics];
+                *c->address = metric->address;
+            }
+            if (metric->bitfield) {
+                const bitfield_t *bitfield = modules_get_bitfield(modules, metric);
+
+                c->bits = bits + (bitfield->names - modules->bit_names);
+                c->bits_count = bitfield->count;
+                for (int k = 0; k < bitfield->count; k++)
+                    c->bits[k] = (char *) (bitfield->names[k] ? bitfield->names[k] : "");
+            }
+        }
+
+        mc->groups = gcs + (module->groups - modules->groups);
+        mc->groups_count = module->groups_count;
+        for (int j = 0; j < module->groups_count; j++) {
+            metric_group_t *group = &module->groups[j];
+            group_config_t *gc = &mc->groups[j];
+
+            gc->name = (char *) group->name;
+            gc->metrics = group_metric;
+            for (int k = 0; k < module->metrics_count; k++) {
+                if (group->select[k] == SELECT_EXPORTED)
+                    gc->metrics[gc->metrics_count++] = (char *) module->metrics[k].name;
+            }
+            group_metric += gc->metrics_count;
+        }
+    }
+
+    cyaml_err_t err = cyaml_save_data(output, len, &cyaml_config,
+                    &modules_schema, &config, 0);
+    if (err == CYAML_OK)
+        ret = 0;
+
+done:
+    free(mcs);
+    free(mcps);
+    free(cs);
+    free(addresses);
+    free(cps);
+    free(bits);
+    free(pcs);
+    free(gcs);
+    free(fds);
+    free(fleet_targets);
+    free(group_metrics);
+    return ret;
+}
+
+module_t *modules_get_module(modules_t *modules, const char *name)
+{
+    uint32_t mask = modules->index_size - 1;
+    uint32_t slot = hash_string(name) & mask;
+
+    while (modules->index[slot]) {
+        module_t *module = &modules->modules[modules->index[slot] - 1];
+        if (!strcmp(module->name, name))
+            return module;
+        slot = (slot + 1) & mask;
     }
 
     return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "exporter485.h"
+
+/* Minimal MQTT 3.1.1 publisher.
+ *
+ * Messages are encoded into complete PUBLISH packets once, and kept in a
+ * bounded queue until they are written (QoS 0) or acknowledged (QoS 1). While
+ * the broker is unreachable the queue fills up, and the oldest messages are
+ * dropped. Unacknowledged messages are sent again, flagged as duplicates,
+ * after reconnecting.
+ */
+#define MQTT_DEFAULT_PORT       1883
+#define MQTT_KEEPALIVE          60      /* Seconds */
+#define MQTT_RETRY_INTERVAL     5       /* Seconds */
+
+#define MQTT_CONNECT            0x10
+#define MQTT_CONNACK            0x20
+#define MQTT_PUBLISH            0x30
+#define MQTT_PUBACK             0x40
+#define MQTT_PINGREQ            0xc0
+#define MQTT_PINGRESP           0xd0
+#define MQTT_DISCONNECT         0xe0
+
+#define MQTT_PUBLISH_DUP        0x08
+#define MQTT_PUBLISH_RETAIN     0x01
+
+typedef struct mqtt_msg {
+    struct mqtt_msg *next;
+    uint16_t packet_id;         /* QoS 1 only */
+    int sent;
+    size_t len;
+    uint8_t packet[];
+} mqtt_msg_t;
+
+struct mqtt {
+    struct event_base *base;
+    char *host;
+    int port;
+    char *client_id;
+    int qos;
+    int retain;
+    unsigned int retry_interval;
+    struct bufferevent *bev;
+    int connected;              /* CONNACK received */
+    int ping_pending;           /* No packet received since the last PINGREQ */
+    struct event *timer;        /* Reconnects, times out connecting or pings */
+    uint16_t next_id;
+    mqtt_msg_t *head;
+    mqtt_msg_t *tail;
+    unsigned int queue_len;
+    unsigned int queue_max;
+    unsigned long dropped;
+};
+
+static void mqtt_connect(mqtt_t *mqtt);
+
+/* Remaining length, encoded 7 bits at a time */
+static size_t put_length(uint8_t *p, size_t len)
+{
+    size_t n = 0;
+
+    do {
+        p[n] = len & 0x7f;
+        len >>= 7;
+        if (len)
+            p[n] |= 0x80;
+        n++;
+    } while (len);
+
+    return n;
+}
+
+static size_t put_string(uint8_t *p, const char *s, size_t len)
+{
+    p[0] = len >> 8;
+    p[1] = len & 0xff;
+    memcpy(p + 2, s, len);
+    return len + 2;
+}
+
+static void send_packet(mqtt_t *mqtt, uint8_t type, const uint8_t *body, size_t len)
+{
+    uint8_t header[5] = { type };
+    size_t n = 1 + put_length(header + 1, len);
+    struct evbuffer *output = bufferevent_get_output(mqtt->bev);
+
+    evbuffer_add(output, header, n);
+    evbuffer_add(output, body, len);
+}
+
+static void send_connect(mqtt_t *mqtt)
+{
+    size_t id_len = strlen(mqtt->client_id);
+    uint8_t *body = malloc(12 + id_len);
+    if (!body)
+        return;
+
+    size_t n = put_string(body, "MQTT", 4);
+    body[n++] = 4;              /* Protocol level 3.1.1 */
+    body[n++] = 0x02;           /* Clean session */
+    body[n++] = MQTT_KEEPALIVE >> 8;
+    body[n++] = MQTT_KEEPALIVE & 0xff;
+    n += put_string(body + n, mqtt->client_id, id_len);
+
+    send_packet(mqtt, MQTT_CONNECT, body, n);
+    free(body);
+}
+
+static void msg_remove(mqtt_t *mqtt, mqtt_msg_t *prev, mqtt_msg_t *msg)
+{
+    if (prev)
+        prev->next = msg->next;
+    else
+        mqtt->head = msg->next;
+    if (mqtt->tail == msg)
+        mqtt->tail = prev;
+    mqtt->queue_len--;
+    free(msg);
+}
+
+/* Writes queued messages. QoS 0 messages are done once written */
+static void flush_queue(mqtt_t *mqtt)
+{
+    mqtt_msg_t *msg = mqtt->head, *prev = NULL;
+
+    if (!mqtt->connected)
+        return;
+
+    struct evbuffer *output = bufferevent_get_output(mqtt->bev);
+    while (msg) {
+        mqtt_msg_t *next = msg->next;
+
+        if (!msg->sent) {
+            evbuffer_add(output, msg->packet, msg->len);
+            if (!mqtt->qos) {
+                msg_remove(mqtt, prev, msg);
+                msg = next;
+                continue;
+            }
+            msg->sent = 1;
+            msg->packet[0] |= MQTT_PUBLISH_DUP;     /* If it must be sent again */
+        }
+        prev = msg;
+        msg = next;
+    }
+}
+
+static void schedule(mqtt_t *mqtt, unsigned int seconds)
+{
+    struct timeval tv = { .tv_sec = seconds };
+
+    event_add(mqtt->timer, &tv);
+}
+
+static void disconnected(mqtt_t *mqtt)
+{
+    if (mqtt->bev)
+        bufferevent_free(mqtt->bev);
+    mqtt->bev = NULL;
+    mqtt->connected = 0;
+    mqtt->ping_pending = 0;
+
+    for (mqtt_msg_t *msg = mqtt->head; msg; msg = msg->next)
+        msg->sent = 0;
+    schedule(mqtt, mqtt->retry_interval);
+}
+
+static void handle_packet(mqtt_t *mqtt, uint8_t type, const uint8_t *body, size_t len)
+{
+    mqtt->ping_pending = 0;
+    switch (type & 0xf0) {
+        case MQTT_CONNACK:
+            if (len < 2 || body[1] != 0) {
+                fprintf(stderr, "mqtt: %s:%d: connection refused (%d)\n", mqtt->host, mqtt->port,
+                        len < 2 ? -1 : body[1]);
+                disconnected(mqtt);
+                return;
+            }
+            mqtt->connected = 1;
+            schedule(mqtt, MQTT_KEEPALIVE / 2);
+            flush_queue(mqtt);
+            break;
+        case MQTT_PUBACK:
+            if (len < 2)
+                break;
+            for (mqtt_msg_t *msg = mqtt->head, *prev = NULL; msg; prev = msg, msg = msg->next) {
+                if (msg->sent && msg->packet_id == (body[0] << 8 | body[1])) {
+                    msg_remove(mqtt, prev, msg);
+                    break;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void read_cb(struct bufferevent *bev, void *arg)
+{
+    mqtt_t *mqtt = (mqtt_t *) arg;
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    while (mqtt->bev) {
+        uint8_t header[5];
+        size_t avail = evbuffer_get_length(input);
+        size_t len = 0, n = 1;
+
+        if (evbuffer_copyout(input, header, avail < 5 ? avail : 5) < 2)
+            return;
+        for (int shift = 0; ; shift += 7, n++) {
+            if (n >= avail)
+                return;     /* Incomplete length */
+            len |= (size_t) (header[n] & 0x7f) << shift;
+            if (!(header[n] & 0x80))
+                break;
+            if (n == 4) {
+                fprintf(stderr, "mqtt: %s:%d: malformed packet length\n", mqtt->host, mqtt->port);
+                disconnected(mqtt);
+                return;
+            }
+        }
+        n++;
+        if (avail < n + len)
+            return;
+
+        uint8_t *packet = evbuffer_pullup(input, n + len);
+        handle_packet(mqtt, packet[0], packet + n, len);
+        if (mqtt->bev)
+            evbuffer_drain(input, n + len);
+    }
+}
+
+static void event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    mqtt_t *mqtt = (mqtt_t *) arg;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        send_connect(mqtt);
+        return;
+    }
+
+    if (what & BEV_EVENT_ERROR)
+        fprintf(stderr, "mqtt: %s:%d: %s\n", mqtt->host, mqtt->port,
+                evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    disconnected(mqtt);
+}
+
+static void timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    mqtt_t *mqtt = (mqtt_t *) arg;
+
+    if (!mqtt->bev) {
+        mqtt_connect(mqtt);
+    } else if (!mqtt->connected || mqtt->ping_pending) {
+        fprintf(stderr, "mqtt: %s:%d: broker not responding\n", mqtt->host, mqtt->port);
+        disconnected(mqtt);
+    } else {
+        send_packet(mqtt, MQTT_PINGREQ, NULL, 0);
+        mqtt->ping_pending = 1;
+        schedule(mqtt, MQTT_KEEPALIVE / 2);
+    }
+}
+
+static void mqtt_connect(mqtt_t *mqtt)
+{
+    mqtt->bev = bufferevent_socket_new(mqtt->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!mqtt->bev) {
+        schedule(mqtt, mqtt->retry_interval);
+        return;
+    }
+
+    bufferevent_setcb(mqtt->bev, read_cb, NULL, event_cb, mqtt);
+    bufferevent_enable(mqtt->bev, EV_READ | EV_WRITE);
+    schedule(mqtt, MQTT_KEEPALIVE / 2);
+    if (bufferevent_socket_connect_hostname(mqtt->bev, NULL, AF_UNSPEC, mqtt->host, mqtt->port) < 0)
+        disconnected(mqtt);
+}
+
+/* Connects to broker (host[:port]) in the background */
+mqtt_t *mqtt_open(struct event_base *base, const char *broker, const char *client_id,
+                  int qos, int retain, unsigned int queue_max)
+{
+    mqtt_t *mqtt = calloc(1, sizeof(mqtt_t));
+    if (!mqtt)
+        return NULL;
+
+    mqtt->base = base;
+    mqtt->host = strdup(broker);
+    mqtt->client_id = strdup(client_id);
+    mqtt->port = MQTT_DEFAULT_PORT;
+    mqtt->qos = qos;
+    mqtt->retain = retain;
+    mqtt->queue_max = queue_max;
+    mqtt->retry_interval = MQTT_RETRY_INTERVAL;
+    mqtt->next_id = 1;
+    if (!mqtt->host || !mqtt->client_id || !(mqtt->timer = evtimer_new(base, timer_cb, mqtt))) {
+        fprintf(stderr, "Failed to allocate mqtt client.\n");
+        goto error;
+    }
+
+    char *port = strrchr(mqtt->host, ':');
+    if (port) {
+        *port++ = '\0';
+        mqtt->port = atoi(port);
+        if (mqtt->port <= 0 || mqtt->port > 65535) {
+            fprintf(stderr, "Invalid mqtt broker port %s.\n", port);
+            goto error;
+        }
+    }
+
+    mqtt_connect(mqtt);
+    return mqtt;
+
+error:
+    if (mqtt->timer)
+        event_free(mqtt->timer);
+    free(mqtt->host);
+    free(mqtt->client_id);
+    free(mqtt);
+    return NULL;
+}
+
+/* Queues a message, and sends it right away if connected */
+int mqtt_publish(mqtt_t *mqtt, const char *topic, const void *payload, size_t len)
+{
+    size_t topic_len = strlen(topic);
+    size_t body_len = 2 + topic_len + (mqtt->qos ? 2 : 0) + len;
+    mqtt_msg_t *msg = malloc(sizeof(mqtt_msg_t) + 5 + body_len);
+    if (!msg)
+        return -1;
+
+    uint8_t *p = msg->packet;
+    *p++ = MQTT_PUBLISH | (mqtt->qos << 1) | (mqtt->retain ? MQTT_PUBLISH_RETAIN : 0);
+    p += put_length(p, body_len);
+    p += put_string(p, topic, topic_len);
+    msg->packet_id = 0;
+    if (mqtt->qos) {
+        msg->packet_id = mqtt->next_id++;
+        if (!mqtt->next_id)
+            mqtt->next_id = 1;  /* Zero is not a valid id */
+        *p++ = msg->packet_id >> 8;
+        *p++ = msg->packet_id & 0xff;
+    }
+    memcpy(p, payload, len);
+    msg->len = p + len - msg->packet;
+    msg->sent = 0;
+    msg->next = NULL;
+
+    if (mqtt->queue_len == mqtt->queue_max) {
+        msg_remove(mqtt, NULL, mqtt->head);
+        if (!(mqtt->dropped++ % 100))
+            fprintf(stderr, "mqtt: queue full, %lu messages dropped\n", mqtt->dropped);
+    }
+
+    if (mqtt->tail)
+        mqtt->tail->next = msg;
+    else
+        mqtt->head = msg;
+    mqtt->tail = msg;
+    mqtt->queue_len++;
+
+    flush_queue(mqtt);
+    return 0;
+}
+
+#ifdef MQTT_TEST
+#include <event2/listener.h>
+#include <arpa/inet.h>
+
+/* A stand-in broker, which acknowledges connections and publications, or
+ * drops the connection instead of acknowledging one.
+ */
+typedef struct broker {
+    struct event_base *base;
+    int received;
+    int expected;
+    int drop_next;
+    int malformed;              /* Answer the next CONNECT with a bad length */
+    char topics[8][32];
+    char payloads[8][32];
+    uint8_t flags[8];
+} broker_t;
+
+static void broker_read_cb(struct bufferevent *bev, void *arg)
+{
+    broker_t *b = (broker_t *) arg;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    struct evbuffer *output = bufferevent_get_output(bev);
+
+    /* Test packets are short, with one byte lengths */
+    while (evbuffer_get_length(input) >= 2) {
+        uint8_t *p = evbuffer_pullup(input, 2);
+        size_t len = p[1];
+        if (evbuffer_get_length(input) < len + 2)
+            return;
+
+        p = evbuffer_pullup(input, len + 2);
+        uint8_t *body = p + 2;
+        switch (p[0] & 0xf0) {
+            case MQTT_CONNECT:
+                if (memcmp(body, "\0\4MQTT\4", 7) != 0) {
+                    printf("broker: bad connect\n");
+                    exit(1);
+                }
+                if (b->malformed) {
+                    b->malformed = 0;
+                    evbuffer_add(output, "\x20\xff\xff\xff\xff\x00", 6);
+                } else {
+                    evbuffer_add(output, "\x20\x02\x00\x00", 4);
+                }
+                break;
+            case MQTT_PUBLISH: {
+                size_t topic_len = body[0] << 8 | body[1];
+                size_t id_len = (p[0] & 0x06) ? 2 : 0;
+                int i = b->received++;
+
+                snprintf(b->topics[i], sizeof(b->topics[i]), "%.*s", (int) topic_len, body + 2);
+                snprintf(b->payloads[i], sizeof(b->payloads[i]), "%.*s",
+                         (int) (len - 2 - topic_len - id_len), body + 2 + topic_len + id_len);
+                b->flags[i] = p[0] & 0x0f;
+                if (b->drop_next) {
+                    b->drop_next = 0;
+                    bufferevent_free(bev);
+                    return;
+                }
+                if (id_len) {
+                    uint8_t puback[4] = { MQTT_PUBACK, 2, body[2 + topic_len], body[3 + topic_len] };
+                    evbuffer_add(output, puback, 4);
+                }
+                if (b->received == b->expected)
+                    event_base_loopbreak(b->base);
+                break;
+            }
+            case MQTT_PINGREQ:
+                evbuffer_add(output, "\xd0\x00", 2);
+                break;
+        }
+        evbuffer_drain(input, len + 2);
+    }
+}
+
+static void broker_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    bufferevent_free(bev);
+}
+
+static void broker_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                             struct sockaddr *addr, int socklen, void *arg)
+{
+    broker_t *b = (broker_t *) arg;
+    struct bufferevent *bev = bufferevent_socket_new(b->base, fd, BEV_OPT_CLOSE_ON_FREE);
+
+    bufferevent_setcb(bev, broker_read_cb, NULL, broker_event_cb, b);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static void run(struct event_base *base, int ms)
+{
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+
+    event_base_loopexit(base, &tv);
+    event_base_dispatch(base);
+}
+
+int main(int argc, char *argv[])
+{
+    struct event_base *base = event_base_new();
+    struct sockaddr_in sin = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t sin_len = sizeof(sin);
+    broker_t broker = { .base = base, .expected = 3, .drop_next = 1 };
+    char addr[32];
+
+    /* Find a free port, and keep the broker down at first */
+    struct evconnlistener *listener = evconnlistener_new_bind(base, broker_accept_cb, &broker,
+        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (struct sockaddr *) &sin, sizeof(sin));
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr *) &sin, &sin_len);
+    evconnlistener_free(listener);
+    snprintf(addr, sizeof(addr), "127.0.0.1:%u", ntohs(sin.sin_port));
+
+    mqtt_t *mqtt = mqtt_open(base, addr, "test", 1, 1, 2);
+    if (!mqtt) exit(1);
+    mqtt->retry_interval = 1;
+
+    /* Queued while the broker is down, the oldest is dropped */
+    mqtt_publish(mqtt, "t/a", "1", 1);
+    mqtt_publish(mqtt, "t/b", "2", 1);
+    mqtt_publish(mqtt, "t/c", "3", 1);
+    run(base, 200);
+    printf("offline: queued %u dropped %lu\n", mqtt->queue_len, mqtt->dropped);
+    if (mqtt->queue_len != 2 || mqtt->dropped != 1) exit(1);
+
+    /* The first connection drops before acknowledging, so both are sent again */
+    listener = evconnlistener_new_bind(base, broker_accept_cb, &broker,
+        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (struct sockaddr *) &sin, sizeof(sin));
+    if (!listener) exit(1);
+    run(base, 10000);
+    run(base, 100);         /* Deliver the last acknowledgement */
+    for (int i = 0; i < broker.received; i++)
+        printf("received: %s %s flags 0x%x\n", broker.topics[i], broker.payloads[i], broker.flags[i]);
+    if (broker.received != 3 ||
+        strcmp(broker.topics[0], "t/b") || strcmp(broker.payloads[0], "2") || broker.flags[0] != 0x03 ||
+        strcmp(broker.topics[1], "t/b") || broker.flags[1] != 0x0b ||
+        strcmp(broker.topics[2], "t/c") || strcmp(broker.payloads[2], "3") || broker.flags[2] != 0x0b)
+        exit(1);
+    printf("acknowledged: queued %u\n", mqtt->queue_len);
+    if (mqtt->queue_len) exit(1);
+
+    /* Once connected, messages go out right away */
+    mqtt_publish(mqtt, "t/d", "4", 1);
+    broker.expected = 4;
+    run(base, 10000);
+    run(base, 100);
+    printf("connected: received %d queued %u\n", broker.received, mqtt->queue_len);
+    if (broker.received != 4 || mqtt->queue_len) exit(1);
+
+    /* A malformed length drops the connection, and the message waits for
+     * the next one.
+     */
+    broker.malformed = 1;
+    disconnected(mqtt);
+    mqtt_publish(mqtt, "t/e", "5", 1);
+    broker.expected = 5;
+    run(base, 10000);
+    printf("malformed: received %d %s\n", broker.received, broker.topics[4]);
+    if (broker.received != 5 || broker.malformed || strcmp(broker.topics[4], "t/e")) exit(1);
+
+    exit(0);
+}
+#endif
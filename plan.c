@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include "exporter485.h"
+
+/* Read plans batch the metrics of a module into as few requests as possible.
+ *
+ * Metrics are sorted by input type and address, and consecutive metrics of
+ * the same type are merged into one block as long as the block does not
+ * exceed the protocol limit, and the unused addresses between them do not
+ * exceed max_gap. Plans specialized for a probed target also leave out the
+ * metrics in its holes, and never merge across one.
+ */
+
+typedef struct plan_limits {
+    unsigned int max_gap;
+    const read_hole_t *holes;
+    unsigned int holes_count;
+} plan_limits_t;
+
+typedef struct plan_entry {
+    uint8_t input_type;
+    uint16_t address;
+    uint16_t count;
+    unsigned int metric;
+} plan_entry_t;
+
+static int is_planned(const metric_t *metric)
+{
+    switch (metric->input_type) {
+        case INPUT_TYPE_HOLDING_REGISTER:
+        case INPUT_TYPE_INPUT_REGISTER:
+        case INPUT_TYPE_COIL:
+        case INPUT_TYPE_DISCRETE_INPUT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int is_bit_type(int input_type)
+{
+    return input_type == INPUT_TYPE_COIL || input_type == INPUT_TYPE_DISCRETE_INPUT;
+}
+
+static uint16_t metric_read_count(const metric_t *metric)
+{
+    if (is_bit_type(metric->input_type))
+        return 1;
+
+    switch (metric->data_type) {
+        case DATA_TYPE_INT32:
+        case DATA_TYPE_UINT32:
+        case DATA_TYPE_FLOAT32:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const plan_entry_t *ea = (const plan_entry_t *) a;
+    const plan_entry_t *eb = (const plan_entry_t *) b;
+
+    if (ea->input_type != eb->input_type)
+        return ea->input_type - eb->input_type;
+    if (ea->address != eb->address)
+        return ea->address - eb->address;
+    return ea->metric - eb->metric;
+}
+
+static void start_block(read_block_t *block, const plan_entry_t *e, uint32_t offset)
+{
+    block->input_type = e->input_type;
+    block->address = e->address;
+    block->count = e->count;
+    block->offset = offset;
+}
+
+static int in_hole(const plan_limits_t *limits, int input_type, unsigned int start, unsigned int end)
+{
+    for (unsigned int i = 0; i < limits->holes_count; i++) {
+        const read_hole_t *h = &limits->holes[i];
+        if (h->input_type == input_type && h->start < end && h->end > start)
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether the unused addresses [start, end) between two metrics are unsafe */
+static int gap_has_hole(const plan_limits_t *limits, int input_type, unsigned int start, unsigned int end)
+{
+    for (unsigned int i = 0; i < limits->holes_count; i++) {
+        const read_hole_t *h = &limits->holes[i];
+        if (h->input_type != input_type)
+            continue;
+        if (h->start == h->end ? (h->start >= start && h->start <= end) :
+                                 (h->start < end && h->end > start))
+            return 1;
+    }
+    return 0;
+}
+
+/* Extends the block to include the entry, if possible */
+static int extend_block(read_block_t *block, const plan_entry_t *e, const plan_limits_t *limits)
+{
+    unsigned int block_end = block->address + block->count;
+    unsigned int end = e->address + e->count;
+    unsigned int max = is_bit_type(e->input_type) ? READ_MAX_BITS : READ_MAX_REGISTERS;
+
+    if (end < block_end)
+        end = block_end;
+    if (e->input_type != block->input_type ||
+        e->address > block_end + limits->max_gap ||
+        end - block->address > max ||
+        (e->address >= block_end && gap_has_hole(limits, e->input_type, block_end, e->address)))
+        return 0;
+
+    block->count = end - block->address;
+    return 1;
+}
+
+static void plan_add_block_size(read_plan_t *plan, const read_block_t *block)
+{
+    if (is_bit_type(block->input_type))
+        plan->bits_count += block->count;
+    else
+        plan->regs_count += block->count;
+}
+
+read_plan_t *read_plan_build(module_t *module, const uint8_t *select, unsigned int max_gap,
+                             const read_hole_t *holes, unsigned int holes_count)
+{
+    plan_limits_t limits = { .max_gap = max_gap, .holes = holes, .holes_count = holes_count };
+    plan_entry_t *entries = calloc(module->metrics_count ? module->metrics_count : 1,
+                                   sizeof(plan_entry_t));
+    unsigned int entries_count = 0;
+    read_plan_t *plan = NULL;
+
+    if (!entries)
+        return NULL;
+
+    for (unsigned int i = 0; i < module->metrics_count; i++) {
+        metric_t *metric = &module->metrics[i];
+        if (!is_planned(metric) || (select && !select[i]))
+            continue;
+
+        plan_entry_t *e = &entries[entries_count];
+        e->input_type = metric->input_type;
+        e->address = metric->address;
+        e->count = metric_read_count(metric);
+        e->metric = i;
+        if (!in_hole(&limits, e->input_type, e->address, e->address + e->count))
+            entries_count++;
+    }
+
+    qsort(entries, entries_count, sizeof(plan_entry_t), compare_entries);
+
+    /* First pass only counts blocks, so the plan is a single allocation */
+    unsigned int blocks_count = 0;
+    read_block_t block = { 0 };
+    for (unsigned int i = 0; i < entries_count; i++) {
+        if (!blocks_count || !extend_block(&block, &entries[i], &limits)) {
+            start_block(&block, &entries[i], 0);
+            blocks_count++;
+        }
+    }
+
+    size_t size = sizeof(read_plan_t) +
+                  blocks_count * sizeof(read_block_t) +
+                  module->metrics_count * sizeof(uint32_t);
+    if (!(plan = calloc(1, size)))
+        goto done;
+
+    plan->size = size;
+    plan->blocks = (read_block_t *) (plan + 1);
+    plan->slots = (uint32_t *) (plan->blocks + blocks_count);
+    for (unsigned int i = 0; i < module->metrics_count; i++)
+        plan->slots[i] = READ_SLOT_NONE;
+
+    read_block_t *cur = NULL;
+    for (unsigned int i = 0; i < entries_count; i++) {
+        plan_entry_t *e = &entries[i];
+
+        if (!cur || !extend_block(cur, e, &limits)) {
+            if (cur)
+                plan_add_block_size(plan, cur);
+            cur = &plan->blocks[plan->blocks_count++];
+            start_block(cur, e, is_bit_type(e->input_type) ? plan->bits_count : plan->regs_count);
+        }
+
+        plan->slots[e->metric] = cur->offset + (e->address - cur->address);
+    }
+    if (cur)
+        plan_add_block_size(plan, cur);
+
+done:
+    free(entries);
+    return plan;
+}
+
+void read_plan_free(read_plan_t *plan)
+{
+    free(plan);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <event2/event.h>
+#include "exporter485.h"
+
+/* Background polling: each configured module/target pair is collected on its
+ * own interval, and the values are fed to the enabled consumers.
+ */
+typedef struct poll_job {
+    exporter_t *exporter;
+    poll_t *poll;
+    struct event *ev;
+} poll_job_t;
+
+static void poll_cb(evutil_socket_t fd, short what, void *arg)
+{
+    poll_job_t *job = (poll_job_t *) arg;
+    exporter_t *exporter = job->exporter;
+    poll_t *poll = job->poll;
+
+    metrics_value_set_t *values = metrics_value_set_collect(exporter, poll->module, poll->target, NULL);
+    if (!values) {
+        fprintf(stderr, "Failed to poll %s target %u\n", poll->module->name, poll->target);
+        return;
+    }
+
+    collect_record(exporter, poll->module, poll->target, values);
+    if (exporter->snapshots)
+        snapshots_publish(exporter->snapshots, poll->module, poll->target, values);
+    if (exporter->streams)
+        streams_publish(exporter->streams, poll, values);
+    if (exporter->options.textfile_dir)
+        textfile_write(exporter, poll->module, poll->target, values);
+
+    metrics_value_set_free(values);
+}
+
+int poll_start(exporter_t *exporter, struct event_base *base)
+{
+    modules_t *modules = exporter->modules;
+
+    for (int i = 0; i < modules->polls_count; i++) {
+        poll_job_t *job = calloc(1, sizeof(poll_job_t));
+        struct timeval tv = { .tv_sec = modules->polls[i].interval };
+
+        job->exporter = exporter;
+        job->poll = &modules->polls[i];
+        job->ev = event_new(base, -1, EV_PERSIST, poll_cb, job);
+        if (!job->ev || event_add(job->ev, &tv) < 0) {
+            fprintf(stderr, "Failed to schedule polling of %s.\n", job->poll->module->name);
+            return -1;
+        }
+
+        /* First collection happens right away */
+        event_active(job->ev, EV_TIMEOUT, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <modbus/modbus.h>
+#include "exporter485.h"
+
+/* Register map probing.
+ *
+ * Devices of the same family often differ in the registers they implement,
+ * and reading an unimplemented address fails the whole request with an
+ * illegal data address exception. The first time a module/target pair is
+ * collected, its plan is read with merging across larger gaps; any block
+ * that fails this way is bisected until the offending metrics, or the
+ * unused addresses between two metrics, are found. These holes are then
+ * left out of a plan specialized for the target, and kept in a cache file
+ * so the probe is not repeated on restart.
+ *
+ * If a specialized plan later hits an illegal address (e.g. after a firmware
+ * update), the target is probed again, starting from what is known.
+ */
+
+#define PROBE_MAX_READ_GAP      16
+#define PROBE_RETRY_INTERVAL    60      /* Seconds after a probe failed for another reason */
+
+typedef struct profile {
+    int probed;                 /* Holes are known */
+    read_hole_t *holes;
+    unsigned int holes_count;
+    read_plan_t *plan;          /* Built on first use */
+    time_t retry_at;
+} profile_t;
+
+struct probe {
+    exporter_t *exporter;
+    const char *cache_file;
+    profile_t **profiles;       /* Indexed by module * (MAX_TARGET + 1) + target */
+};
+
+typedef struct span_metric {
+    uint32_t address;
+    uint32_t end;
+} span_metric_t;
+
+static profile_t *get_profile(probe_t *probe, module_t *module, int target)
+{
+    modules_t *modules = probe->exporter->modules;
+    profile_t **slot = &probe->profiles[(module - modules->modules) * (MAX_TARGET + 1) + target];
+
+    if (!*slot)
+        *slot = calloc(1, sizeof(profile_t));
+    return *slot;
+}
+
+static unsigned int probe_max_gap(module_t *module)
+{
+    return module->max_read_gap > PROBE_MAX_READ_GAP ? module->max_read_gap : PROBE_MAX_READ_GAP;
+}
+
+static int add_hole(profile_t *profile, int input_type, unsigned int start, unsigned int end)
+{
+    read_hole_t *holes = realloc(profile->holes, (profile->holes_count + 1) * sizeof(read_hole_t));
+    if (!holes)
+        return -1;
+
+    profile->holes = holes;
+    profile->holes[profile->holes_count++] = (read_hole_t) {
+        .start = start,
+        .end = end,
+        .input_type = input_type
+    };
+    return 0;
+}
+
+/* Reads the metrics [lo, hi) of a block in one request, bisecting on illegal
+ * address errors. Returns 0 if the span is readable, 1 if holes were found
+ * in it, or -1 if probing failed for another reason.
+ */
+static int probe_span(exporter_t *exporter, int target, int input_type, profile_t *profile,
+                      const span_metric_t *metrics, unsigned int lo, unsigned int hi)
+{
+    static uint16_t regs[READ_MAX_REGISTERS];
+    static uint8_t bits[READ_MAX_BITS];
+    unsigned int end = 0;
+
+    for (unsigned int i = lo; i < hi; i++) {
+        if (metrics[i].end > end)
+            end = metrics[i].end;
+    }
+
+    read_block_t block = {
+        .address = metrics[lo].address,
+        .count = end - metrics[lo].address,
+        .input_type = input_type
+    };
+    if (collect_read_block(exporter, target, &block, regs, bits) == 0)
+        return 0;
+    if (errno != EMBXILADD)
+        return -1;
+    if (hi - lo == 1)
+        return add_hole(profile, input_type, block.address, end) < 0 ? -1 : 1;
+
+    unsigned int mid = (lo + hi) / 2;
+    int left = probe_span(exporter, target, input_type, profile, metrics, lo, mid);
+    if (left < 0)
+        return -1;
+    int right = probe_span(exporter, target, input_type, profile, metrics, mid, hi);
+    if (right < 0)
+        return -1;
+
+    /* Both halves are readable, so the addresses between them are not */
+    if (!left && !right) {
+        unsigned int left_end = 0;
+        for (unsigned int i = lo; i < mid; i++) {
+            if (metrics[i].end > left_end)
+                left_end = metrics[i].end;
+        }
+        unsigned int right_start = metrics[mid].address;
+        if (right_start < left_end)
+            right_start = left_end;
+        if (add_hole(profile, input_type, left_end, right_start) < 0)
+            return -1;
+    }
+
+    return 1;
+}
+
+/* Registers (or bits) read for a metric */
+static unsigned int metric_width(const metric_t *metric)
+{
+    if (metric->input_type == INPUT_TYPE_COIL || metric->input_type == INPUT_TYPE_DISCRETE_INPUT)
+        return 1;
+
+    switch (metric->data_type) {
+        case DATA_TYPE_INT32:
+        case DATA_TYPE_UINT32:
+        case DATA_TYPE_FLOAT32:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+static int compare_span_metrics(const void *a, const void *b)
+{
+    const span_metric_t *ma = (const span_metric_t *) a;
+    const span_metric_t *mb = (const span_metric_t *) b;
+
+    return ma->address != mb->address ? ma->address - mb->address : ma->end - mb->end;
+}
+
+static int probe_target(probe_t *probe, module_t *module, int target, profile_t *profile)
+{
+    exporter_t *exporter = probe->exporter;
+    unsigned int holes_count = profile->holes_count;
+    int ret = -1;
+
+    read_plan_t *plan = read_plan_build(module, NULL, probe_max_gap(module),
+                                        profile->holes, profile->holes_count);
+    span_metric_t *metrics = calloc(module->metrics_count + 1, sizeof(span_metric_t));
+    if (!plan || !metrics)
+        goto done;
+
+    if (!exporter->options.dry_run)
+        modbus_set_slave(exporter->modbus, target);
+
+    for (unsigned int b = 0; b < plan->blocks_count; b++) {
+        read_block_t *block = &plan->blocks[b];
+        unsigned int count = 0;
+
+        for (unsigned int i = 0; i < module->metrics_count; i++) {
+            metric_t *metric = &module->metrics[i];
+            uint32_t slot = plan->slots[i];
+
+            if (slot == READ_SLOT_NONE || metric->input_type != block->input_type ||
+                slot < block->offset || slot >= block->offset + block->count)
+                continue;
+
+            metrics[count].address = metric->address;
+            metrics[count].end = metric->address + metric_width(metric);
+            count++;
+        }
+        if (!count)
+            continue;
+
+        qsort(metrics, count, sizeof(span_metric_t), compare_span_metrics);
+        if (probe_span(exporter, target, block->input_type, profile, metrics, 0, count) < 0) {
+            fprintf(stderr, "%s: target %d: probe failed: %s\n", module->name, target,
+                    modbus_strerror(errno));
+            goto done;
+        }
+    }
+
+    if (profile->holes_count > holes_count)
+        fprintf(stderr, "%s: target %d: probe found %u unsupported address ranges\n",
+                module->name, target, profile->holes_count - holes_count);
+    profile->probed = 1;
+    ret = 0;
+
+done:
+    if (plan)
+        read_plan_free(plan);
+    free(metrics);
+    return ret;
+}
+
+/* The cache is a text file, with a line per probed module/target pair,
+ * followed by a line per hole:
+ *
+ *   <module> <target>
+ *   <module> <target> <input type> <start> <end>
+ */
+static void save_cache(probe_t *probe)
+{
+    modules_t *modules = probe->exporter->modules;
+    char tmp[1024];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", probe->cache_file);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    for (unsigned int m = 0; m < modules->modules_count; m++) {
+        for (int target = 1; target <= MAX_TARGET; target++) {
+            profile_t *profile = probe->profiles[m * (MAX_TARGET + 1) + target];
+            if (!profile || !profile->probed)
+                continue;
+
+            const char *name = modules->modules[m].name;
+            fprintf(f, "%s %d\n", name, target);
+            for (unsigned int i = 0; i < profile->holes_count; i++) {
+                read_hole_t *h = &profile->holes[i];
+                fprintf(f, "%s %d %s 0x%04x 0x%04x\n", name, target,
+                        get_input_type_str(h->input_type), h->start, h->end);
+            }
+        }
+    }
+
+    if (fclose(f) != 0 || rename(tmp, probe->cache_file) < 0) {
+        fprintf(stderr, "%s: %s\n", probe->cache_file, strerror(errno));
+        remove(tmp);
+    }
+}
+
+static void load_cache(probe_t *probe)
+{
+    FILE *f = fopen(probe->cache_file, "r");
+    char line[256];
+
+    if (!f) {
+        if (errno != ENOENT)
+            fprintf(stderr, "%s: %s\n", probe->cache_file, strerror(errno));
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char module_name[128], input_type_str[32];
+        unsigned int start, end;
+        int target;
+
+        int n = sscanf(line, "%127s %d %31s %i %i", module_name, &target, input_type_str,
+                       &start, &end);
+        if (n < 2)
+            continue;
+
+        /* Pairs of modules no longer configured are dropped */
+        module_t *module = modules_get_module(probe->exporter->modules, module_name);
+        if (!module || target < 1 || target > MAX_TARGET)
+            continue;
+
+        profile_t *profile = get_profile(probe, module, target);
+        if (!profile)
+            continue;
+        profile->probed = 1;
+
+        int input_type = n == 5 ? get_input_type(input_type_str) : -1;
+        if (input_type >= 0 && start <= end && end <= UINT16_MAX)
+            add_hole(profile, input_type, start, end);
+    }
+
+    fclose(f);
+}
+
+probe_t *probe_open(exporter_t *exporter, const char *cache_file)
+{
+    probe_t *probe = calloc(1, sizeof(probe_t));
+    if (!probe)
+        return NULL;
+
+    probe->exporter = exporter;
+    probe->cache_file = cache_file;
+    probe->profiles = calloc(exporter->modules->modules_count * (MAX_TARGET + 1),
+                             sizeof(profile_t *));
+    if (!probe->profiles) {
+        free(probe);
+        return NULL;
+    }
+
+    if (cache_file)
+        load_cache(probe);
+    return probe;
+}
+
+/* Returns the plan specialized for the target, probing it first if needed,
+ * or NULL to use the module's plan. Plans for groups are built on each call
+ * and flagged as temporary.
+ */
+read_plan_t *probe_get_plan(exporter_t *exporter, module_t *module, int target,
+                            const metric_group_t *group, int *temporary)
+{
+    probe_t *probe = exporter->probe;
+    struct timespec now;
+
+    *temporary = 0;
+    if (module->module_type != MODULE_TYPE_MODBUS)
+        return NULL;
+
+    profile_t *profile = get_profile(probe, module, target);
+    if (!profile)
+        return NULL;
+
+    if (!profile->probed) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < profile->retry_at)
+            return NULL;
+
+        if (profile->plan) {
+            read_plan_free(profile->plan);
+            profile->plan = NULL;
+        }
+        if (probe_target(probe, module, target, profile) < 0) {
+            profile->retry_at = now.tv_sec + PROBE_RETRY_INTERVAL;
+            return NULL;
+        }
+        if (probe->cache_file)
+            save_cache(probe);
+    }
+
+    if (group) {
+        *temporary = 1;
+        return read_plan_build(module, group->select, probe_max_gap(module),
+                               profile->holes, profile->holes_count);
+    }
+
+    if (!profile->plan)
+        profile->plan = read_plan_build(module, NULL, probe_max_gap(module),
+                                        profile->holes, profile->holes_count);
+    return profile->plan;
+}
+
+/* Called while the current plan may still be in use, so it is only freed
+ * when the target is probed again.
+ */
+void probe_invalidate(exporter_t *exporter, module_t *module, int target)
+{
+    profile_t *profile = get_profile(exporter->probe, module, target);
+
+    if (profile)
+        profile->probed = 0;
+}
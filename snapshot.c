@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "exporter485.h"
+
+/* Latest values of every background polled module/target pair.
+ *
+ * The bus thread publishes each poll result into a slot allocated at startup,
+ * under a sequence lock: readers on HTTP worker threads copy the values without
+ * taking any lock and retry if a publication raced with the copy, so serving
+ * polled data never waits for the bus.
+ */
+typedef struct snapshot {
+    atomic_uint seq;            /* Odd while a publication is in progress, 0 if none yet */
+    module_t *module;
+    int target;
+    int64_t timestamp;
+    unsigned int errors;
+    metric_value_t *values;
+    uint8_t *valid;
+} snapshot_t;
+
+struct snapshots {
+    snapshot_t *slots;
+    unsigned int count;
+};
+
+snapshots_t *snapshots_create(modules_t *modules)
+{
+    snapshots_t *snapshots = calloc(1, sizeof(snapshots_t));
+    if (!snapshots)
+        return NULL;
+
+    snapshots->count = modules->polls_count;
+    snapshots->slots = calloc(snapshots->count, sizeof(snapshot_t));
+    if (snapshots->count && !snapshots->slots)
+        goto error;
+
+    for (int i = 0; i < snapshots->count; i++) {
+        snapshot_t *slot = &snapshots->slots[i];
+        poll_t *poll = &modules->polls[i];
+
+        atomic_init(&slot->seq, 0);
+        slot->module = poll->module;
+        slot->target = poll->target;
+        slot->values = calloc(poll->module->metrics_count, sizeof(metric_value_t));
+        slot->valid = calloc(poll->module->metrics_count, sizeof(uint8_t));
+        if (!slot->values || !slot->valid)
+            goto error;
+    }
+
+    return snapshots;
+
+error:
+    snapshots_free(snapshots);
+    return NULL;
+}
+
+void snapshots_free(snapshots_t *snapshots)
+{
+    for (int i = 0; i < snapshots->count && snapshots->slots; i++) {
+        free(snapshots->slots[i].values);
+        free(snapshots->slots[i].valid);
+    }
+    free(snapshots->slots);
+    free(snapshots);
+}
+
+static snapshot_t *find_slot(snapshots_t *snapshots, module_t *module, int target)
+{
+    for (int i = 0; i < snapshots->count; i++) {
+        if (snapshots->slots[i].module == module && snapshots->slots[i].target == target)
+            return &snapshots->slots[i];
+    }
+
+    return NULL;
+}
+
+/* Called by the bus thread only, so there is a single writer per slot */
+void snapshots_publish(snapshots_t *snapshots, module_t *module, int target,
+                       metrics_value_set_t *values)
+{
+    snapshot_t *slot = find_slot(snapshots, module, target);
+    if (!slot)
+        return;
+
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(slot->values, values->values, values->values_count * sizeof(metric_value_t));
+    memcpy(slot->valid, values->valid, values->values_count * sizeof(uint8_t));
+    slot->timestamp = values->timestamp;
+    slot->errors = values->errors;
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/* Returns a copy of the latest published values, or NULL if the pair is not
+ * polled or has not been polled yet.
+ */
+metrics_value_set_t *snapshots_read(snapshots_t *snapshots, module_t *module, int target)
+{
+    snapshot_t *slot = find_slot(snapshots, module, target);
+    if (!slot || !atomic_load_explicit(&slot->seq, memory_order_acquire))
+        return NULL;
+
+    metrics_value_set_t *values = calloc(1, sizeof(metrics_value_set_t));
+    if (!values)
+        return NULL;
+
+    values->values_count = module->metrics_count;
+    values->values = malloc(values->values_count * sizeof(metric_value_t));
+    values->valid = malloc(values->values_count * sizeof(uint8_t));
+    if (!values->values || !values->valid) {
+        metrics_value_set_free(values);
+        return NULL;
+    }
+
+    unsigned int seq;
+    do {
+        while ((seq = atomic_load_explicit(&slot->seq, memory_order_acquire)) & 1)
+            ;
+
+        memcpy(values->values, slot->values, values->values_count * sizeof(metric_value_t));
+        memcpy(values->valid, slot->valid, values->values_count * sizeof(uint8_t));
+        values->timestamp = slot->timestamp;
+        values->errors = slot->errors;
+
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq);
+
+    return values;
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+#include "exporter485.h"
+
+/* Live values of background polled pairs, as Server-Sent Events.
+ *
+ * Each poll result is compared with the values last streamed for the pair,
+ * and metrics that changed (by more than their deadband) are encoded once
+ * into a shared message. Connections belong to the thread that accepted them,
+ * so the message is handed to each event base with subscribers, which adds it
+ * to their output by reference.
+ */
+typedef struct stream_msg {
+    atomic_uint refs;
+    size_t len;
+    char data[];
+} stream_msg_t;
+
+typedef struct subscriber {
+    streams_t *streams;
+    struct evhttp_request *req;
+    struct event_base *base;
+    unsigned int poll;
+    struct subscriber *next;
+} subscriber_t;
+
+/* Values last streamed for a poll, only used by the bus thread */
+typedef struct stream_state {
+    metric_value_t *values;
+    uint8_t *valid;
+} stream_state_t;
+
+struct streams {
+    exporter_t *exporter;
+    pthread_mutex_t lock;       /* Protects the subscriber list */
+    subscriber_t *subscribers;
+    stream_state_t *states;     /* Indexed by poll */
+};
+
+typedef struct delivery {
+    streams_t *streams;
+    stream_msg_t *msg;
+    struct event_base *base;
+    unsigned int poll;
+} delivery_t;
+
+streams_t *streams_create(exporter_t *exporter)
+{
+    modules_t *modules = exporter->modules;
+    streams_t *streams = calloc(1, sizeof(streams_t));
+    if (!streams)
+        return NULL;
+
+    streams->exporter = exporter;
+    pthread_mutex_init(&streams->lock, NULL);
+    if (!(streams->states = calloc(modules->polls_count, sizeof(stream_state_t))))
+        goto error;
+
+    for (int i = 0; i < modules->polls_count; i++) {
+        module_t *module = modules->polls[i].module;
+        stream_state_t *state = &streams->states[i];
+
+        state->values = calloc(module->metrics_count, sizeof(metric_value_t));
+        state->valid = calloc(module->metrics_count, sizeof(uint8_t));
+        if (!state->values || !state->valid)
+            goto error;
+    }
+
+    return streams;
+
+error:
+    for (int i = 0; i < modules->polls_count && streams->states; i++) {
+        free(streams->states[i].values);
+        free(streams->states[i].valid);
+    }
+    free(streams->states);
+    free(streams);
+    return NULL;
+}
+
+static void msg_unref(stream_msg_t *msg)
+{
+    if (atomic_fetch_sub(&msg->refs, 1) == 1)
+        free(msg);
+}
+
+static void msg_cleanup(const void *data, size_t len, void *arg)
+{
+    msg_unref((stream_msg_t *) arg);
+}
+
+static void send_msg(subscriber_t *sub, stream_msg_t *msg)
+{
+    struct evbuffer *buf = evbuffer_new();
+    if (!buf)
+        return;
+
+    atomic_fetch_add(&msg->refs, 1);
+    if (evbuffer_add_reference(buf, msg->data, msg->len, msg_cleanup, msg) < 0)
+        msg_unref(msg);
+    else
+        evhttp_send_reply_chunk(sub->req, buf);
+    evbuffer_free(buf);
+}
+
+static double value_of(const metric_t *metric, const metric_value_t *value)
+{
+    switch (metric->data_type) {
+        case DATA_TYPE_FLOAT16:
+        case DATA_TYPE_FLOAT32:
+            return value->float_value;
+        case DATA_TYPE_INT16:
+        case DATA_TYPE_INT32:
+            return value->int_value;
+        default:
+            return value->uint_value;
+    }
+}
+
+/* Bitfields are streamed on any change, as their value is not a quantity */
+static int value_changed(const metric_t *metric, float deadband,
+                         const metric_value_t *a, const metric_value_t *b)
+{
+    double x = value_of(metric, a), y = value_of(metric, b);
+
+    if (!deadband || metric->bitfield)
+        return x != y;
+    return fabs(x - y) > deadband;
+}
+
+/* Renders the metrics set in `select` as a JSON object, and returns the
+ * number of values rendered.
+ */
+int streams_render_json(struct evbuffer *buf, module_t *module, metrics_value_set_t *values,
+                        const uint8_t *select)
+{
+    int count = 0;
+
+    evbuffer_add_printf(buf, "{\"timestamp\":%lld,\"errors\":%u,\"values\":{",
+                        (long long) values->timestamp, values->errors);
+    for (int i = 0; i < module->metrics_count; i++) {
+        metric_t *metric = &module->metrics[i];
+        double value = value_of(metric, &values->values[i]);
+
+        if (!select[i] || !isfinite(value))
+            continue;
+        evbuffer_add_printf(buf, "%s\"%s\":%.7g", count++ ? "," : "", metric->name, value);
+    }
+    evbuffer_add_printf(buf, "}}");
+    return count;
+}
+
+/* Encodes an event of the metrics set in `streamed`, or returns NULL if none */
+static stream_msg_t *encode(module_t *module, metrics_value_set_t *values, const uint8_t *streamed)
+{
+    struct evbuffer *buf = evbuffer_new();
+    stream_msg_t *msg = NULL;
+
+    if (!buf)
+        return NULL;
+
+    evbuffer_add_printf(buf, "event: metrics\ndata: ");
+    int count = streams_render_json(buf, module, values, streamed);
+    evbuffer_add_printf(buf, "\n\n");
+
+    size_t len = evbuffer_get_length(buf);
+    if (count && (msg = malloc(sizeof(stream_msg_t) + len))) {
+        atomic_init(&msg->refs, 1);
+        msg->len = len;
+        evbuffer_remove(buf, msg->data, len);
+    }
+    evbuffer_free(buf);
+    return msg;
+}
+
+static void deliver_cb(evutil_socket_t fd, short what, void *arg)
+{
+    delivery_t *d = (delivery_t *) arg;
+
+    pthread_mutex_lock(&d->streams->lock);
+    for (subscriber_t *sub = d->streams->subscribers; sub; sub = sub->next) {
+        if (sub->base == d->base && sub->poll == d->poll)
+            send_msg(sub, d->msg);
+    }
+    pthread_mutex_unlock(&d->streams->lock);
+
+    msg_unref(d->msg);
+    free(d);
+}
+
+/* Hands the message to every event base with subscribers of the poll */
+static void dispatch(streams_t *streams, unsigned int poll, stream_msg_t *msg)
+{
+    for (subscriber_t *sub = streams->subscribers; sub; sub = sub->next) {
+        if (sub->poll != poll)
+            continue;
+
+        subscriber_t *prev = streams->subscribers;
+        while (prev != sub && (prev->poll != poll || prev->base != sub->base))
+            prev = prev->next;
+        if (prev != sub)
+            continue;   /* Base already handled */
+
+        delivery_t *d = malloc(sizeof(delivery_t));
+        if (!d)
+            continue;
+        *d = (delivery_t) { .streams = streams, .msg = msg, .base = sub->base, .poll = poll };
+        atomic_fetch_add(&msg->refs, 1);
+        if (event_base_once(sub->base, -1, EV_TIMEOUT, deliver_cb, d, NULL) < 0) {
+            msg_unref(msg);
+            free(d);
+        }
+    }
+}
+
+/* Called by the bus thread with every result of a poll */
+void streams_publish(streams_t *streams, poll_t *poll, metrics_value_set_t *values)
+{
+    unsigned int index = poll - streams->exporter->modules->polls;
+    stream_state_t *state = &streams->states[index];
+    module_t *module = poll->module;
+    uint8_t streamed[module->metrics_count];
+
+    for (int i = 0; i < module->metrics_count; i++) {
+        streamed[i] = values->valid[i] &&
+                (!state->valid[i] ||
+                 value_changed(&module->metrics[i], module->deadbands ? module->deadbands[i] : 0,
+                               &state->values[i], &values->values[i]));
+        if (streamed[i]) {
+            state->values[i] = values->values[i];
+            state->valid[i] = 1;
+        }
+    }
+
+    pthread_mutex_lock(&streams->lock);
+    subscriber_t *sub = streams->subscribers;
+    while (sub && sub->poll != index)
+        sub = sub->next;
+
+    stream_msg_t *msg = sub ? encode(module, values, streamed) : NULL;
+    if (msg) {
+        dispatch(streams, index, msg);
+        msg_unref(msg);
+    }
+    pthread_mutex_unlock(&streams->lock);
+}
+
+static void unsubscribe_cb(struct evhttp_connection *evcon, void *arg)
+{
+    subscriber_t *sub = (subscriber_t *) arg;
+    streams_t *streams = sub->streams;
+
+    pthread_mutex_lock(&streams->lock);
+    for (subscriber_t **p = &streams->subscribers; *p; p = &(*p)->next) {
+        if (*p == sub) {
+            *p = sub->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&streams->lock);
+    free(sub);
+}
+
+/* Starts streaming a poll to the client, beginning with all of its latest
+ * values. The response never ends, the subscriber is removed once the client
+ * disconnects.
+ */
+int streams_subscribe(streams_t *streams, struct evhttp_request *req, poll_t *poll)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    subscriber_t *sub = calloc(1, sizeof(subscriber_t));
+    if (!sub)
+        return -1;
+
+    sub->streams = streams;
+    sub->req = req;
+    sub->base = evhttp_connection_get_base(evcon);
+    sub->poll = poll - streams->exporter->modules->polls;
+
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Content-Type", "text/event-stream");
+    evhttp_add_header(headers, "Cache-Control", "no-cache");
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+
+    /* Deliveries to this subscriber run on this thread, so none can be
+     * missed or sent ahead of the initial values.
+     */
+    pthread_mutex_lock(&streams->lock);
+    sub->next = streams->subscribers;
+    streams->subscribers = sub;
+    pthread_mutex_unlock(&streams->lock);
+    evhttp_connection_set_closecb(evcon, unsubscribe_cb, sub);
+
+    metrics_value_set_t *values = snapshots_read(streams->exporter->snapshots, poll->module,
+                                                 poll->target);
+    if (values) {
+        stream_msg_t *msg = encode(poll->module, values, values->valid);
+        if (msg) {
+            send_msg(sub, msg);
+            msg_unref(msg);
+        }
+        metrics_value_set_free(values);
+    }
+
+    return 0;
+}
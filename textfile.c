@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <event2/buffer.h>
+#include "exporter485.h"
+
+/* Writes the metrics of a polled pair for the node_exporter textfile
+ * collector, as DIR/exporter485_<module>_<target>.prom. The file is written
+ * under a name the collector ignores and renamed into place, so it is never
+ * read partially written. Series are labeled with the module and target, as
+ * the collector merges all files.
+ */
+int textfile_write(exporter_t *exporter, module_t *module, int target, metrics_value_set_t *values)
+{
+    const char *dir = exporter->options.textfile_dir;
+    char path[4096], tmp_path[4096], labels[128];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/exporter485_%s_%d.prom", dir, module->name, target);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.exporter485_%s_%d.prom.tmp", dir, module->name, target);
+    snprintf(labels, sizeof(labels), "module=\"%s\",target=\"%d\"", module->name, target);
+
+    struct evbuffer *buf = render_metrics(exporter, module, target, NULL, values, labels);
+    if (!buf)
+        return -1;
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        goto error;
+    while (evbuffer_get_length(buf) > 0) {
+        if (evbuffer_write(buf, fd) < 0) {
+            close(fd);
+            unlink(tmp_path);
+            goto error;
+        }
+    }
+    if (close(fd) < 0 || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        goto error;
+    }
+
+    evbuffer_free(buf);
+    return 0;
+
+error:
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    evbuffer_free(buf);
+    return -1;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2023, Yossi Gottlieb <yossigo@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/listener.h>
+#include "exporter485.h"
+
+/* HTTP worker threads.
+ *
+ * Each worker runs its own event base and HTTP server, with its own
+ * SO_REUSEPORT listener so the kernel spreads connections among them. The
+ * main thread remains the bus thread: it owns the serial port, and workers
+ * hand it live collections as one-shot events on its base. Polled values are
+ * read from the published snapshots and never involve the bus thread.
+ */
+typedef struct http_worker {
+    pthread_t thread;
+    struct event_base *base;
+    struct evhttp *http;
+} http_worker_t;
+
+struct workers {
+    struct event_base *bus_base;
+    http_worker_t *threads;
+    unsigned int count;
+};
+
+static void *worker_main(void *arg)
+{
+    http_worker_t *worker = (http_worker_t *) arg;
+
+    event_base_dispatch(worker->base);
+    return NULL;
+}
+
+/* Workers are started once the exporter is otherwise set up, as they may
+ * serve requests right away.
+ */
+int workers_start(exporter_t *exporter, struct event_base *bus_base)
+{
+    options_t *o = &exporter->options;
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(o->port)
+    };
+
+    if (inet_pton(AF_INET, o->bind_addr, &sin.sin_addr) != 1) {
+        fprintf(stderr, "Invalid bind address %s.\n", o->bind_addr);
+        return -1;
+    }
+
+    workers_t *workers = calloc(1, sizeof(workers_t));
+    workers->bus_base = bus_base;
+    workers->threads = calloc(o->http_threads, sizeof(http_worker_t));
+    exporter->workers = workers;
+
+    for (int i = 0; i < o->http_threads; i++) {
+        http_worker_t *worker = &workers->threads[i];
+        struct evconnlistener *listener;
+
+        if (!(worker->base = event_base_new()) ||
+            !(worker->http = http_new(exporter, worker->base))) {
+            fprintf(stderr, "Failed to create http worker.\n");
+            return -1;
+        }
+
+        if (o->port) {
+            listener = evconnlistener_new_bind(worker->base, NULL, NULL,
+                    LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE, -1,
+                    (struct sockaddr *) &sin, sizeof(sin));
+            if (!listener || !evhttp_bind_listener(worker->http, listener)) {
+                fprintf(stderr, "Failed to bind to socket.\n");
+                return -1;
+            }
+        }
+
+        /* A Unix socket can not be shared, the first worker serves it */
+        if (!i && o->unix_socket && http_bind_unix(worker->http, worker->base, o->unix_socket) < 0)
+            return -1;
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to start http worker.\n");
+            return -1;
+        }
+        workers->count++;
+    }
+
+    return 0;
+}
+
+/* Runs on the worker thread if the client disconnects while the collection
+ * is in progress.
+ */
+static void job_cancel_cb(struct evhttp_connection *evcon, void *arg)
+{
+    collect_job_t *job = (collect_job_t *) arg;
+
+    job->cancelled = 1;
+}
+
+static void job_done_cb(evutil_socket_t fd, short what, void *arg)
+{
+    collect_job_t *job = (collect_job_t *) arg;
+
+    /* A request whose connection is gone is still owned by us, and replying
+     * to it is how libevent frees it.
+     */
+    if (job->cancelled) {
+        evhttp_send_reply(job->req, HTTP_SERVUNAVAIL, NULL, NULL);
+    } else {
+        evhttp_connection_set_closecb(evhttp_request_get_connection(job->req), NULL, NULL);
+        job->done(job);
+    }
+
+    if (job->values)
+        metrics_value_set_free(job->values);
+    if (job->group)
+        modules_group_free(job->group);
+    free(job);
+}
+
+static void job_collect_cb(evutil_socket_t fd, short what, void *arg)
+{
+    collect_job_t *job = (collect_job_t *) arg;
+    exporter_t *exporter = job->exporter;
+
+    job->values = metrics_value_set_collect(exporter, job->module, job->target, job->group);
+    if (job->values)
+        collect_record(exporter, job->module, job->target, job->values);
+
+    /* The job is still referenced by the connection, so it can only be
+     * leaked if it cannot be handed back.
+     */
+    if (event_base_once(job->base, -1, EV_TIMEOUT, job_done_cb, job, NULL) < 0)
+        fprintf(stderr, "Failed to complete collection of %s target %d\n",
+                job->module->name, job->target);
+}
+
+int workers_collect(exporter_t *exporter, struct evhttp_request *req, module_t *module,
+                    int target, metric_group_t *group, collect_done_fn done)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    collect_job_t *job = calloc(1, sizeof(collect_job_t));
+    if (!job)
+        return -1;
+
+    job->exporter = exporter;
+    job->module = module;
+    job->target = target;
+    job->group = group;
+    job->req = req;
+    job->done = done;
+    job->base = evhttp_connection_get_base(evcon);
+
+    if (event_base_once(exporter->workers->bus_base, -1, EV_TIMEOUT, job_collect_cb, job, NULL) < 0) {
+        free(job);
+        return -1;
+    }
+
+    /* Completion is delivered on this thread, so it cannot happen before this */
+    evhttp_connection_set_closecb(evcon, job_cancel_cb, job);
+    return 0;
+}